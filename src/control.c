@@ -0,0 +1,96 @@
+/*
+ * Copyright 2017, Andrej Kislovskij
+ *
+ * This is PUBLIC DOMAIN software so use at your own risk as it comes
+ * with no warranties. This code is yours to share, use and modify without
+ * any restrictions or obligations.
+ *
+ * For more information see conwrap/LICENSE or refer refer to http://unlicense.org
+ *
+ * Author: gimesketvirtadieni at gmail dot com (Andrej Kislovskij)
+ */
+
+/*
+ * slimplexor-control reads and changes settings in the shared memory control segment used by SlimPlexor
+ * (see volume_control option); the segment layout is defined in control.h.
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include "slimplexor.h"
+
+
+/* control tool uses its own logging settings */
+__thread unsigned int log_level = 2;
+__thread FILE*        log_file  = NULL;
+
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [options] <control name>\n", name);
+    fprintf(stderr, "  -g <percent>  set volume in percent of unity gain (0 .. %d)\n", CONTROL_GAIN_MAX / CONTROL_GAIN_UNITY * 100);
+    fprintf(stderr, "  -m <on|off>   mute or unmute\n");
+}
+
+
+int main(int argc, char* argv[])
+{
+    control_t* control = NULL;
+    long       gain    = -1;
+    int        mute    = -1;
+    int        option;
+
+    log_file = stderr;
+
+    while ((option = getopt(argc, argv, "g:m:")) != -1)
+    {
+        switch (option)
+        {
+            case 'g':
+                gain = strtol(optarg, NULL, 10);
+                break;
+            case 'm':
+                mute = (strcasecmp(optarg, "on") == 0);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc || (gain != -1 && (gain < 0 || gain * CONTROL_GAIN_UNITY / 100 > CONTROL_GAIN_MAX)))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!(control = open_control(argv[optind])))
+    {
+        return 1;
+    }
+
+    if (gain >= 0)
+    {
+        control->gain = gain * CONTROL_GAIN_UNITY / 100;
+    }
+    if (mute >= 0)
+    {
+        control->mute = mute;
+    }
+
+    fprintf(stdout, "volume: %u%% (%.1f dB)\n", control->gain * 100 / CONTROL_GAIN_UNITY, control->gain ? 20 * log10((double)control->gain / CONTROL_GAIN_UNITY) : -INFINITY);
+    fprintf(stdout, "mute:   %s\n", control->mute ? "on" : "off");
+
+    /* levels are published only if metering is enabled in plugin configuration */
+    control_meters_t meters;
+    control_read_meters(control, &meters);
+    for (uint32_t c = 0; meters.windows && c < meters.channels; c++)
+    {
+        fprintf(stdout, "level %u: peak %.1f dBFS, RMS %.1f dBFS\n", c,
+            meters.peak[c] ? 20 * log10((double)meters.peak[c] / CONTROL_METER_FULL_SCALE) : -INFINITY,
+            meters.rms[c]  ? 20 * log10((double)meters.rms[c]  / CONTROL_METER_FULL_SCALE) : -INFINITY);
+    }
+
+    close_control(control);
+
+    return 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2017, Andrej Kislovskij
+ *
+ * This is PUBLIC DOMAIN software so use at your own risk as it comes
+ * with no warranties. This code is yours to share, use and modify without
+ * any restrictions or obligations.
+ *
+ * For more information see conwrap/LICENSE or refer refer to http://unlicense.org
+ *
+ * Author: gimesketvirtadieni at gmail dot com (Andrej Kislovskij)
+ */
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdint.h>
+
+
+/* layout of the POSIX shared memory segment used to control SlimPlexor from other processes (see volume_control option) */
+#define CONTROL_MAGIC              0x58504C53  /* 'SLPX' */
+#define CONTROL_VERSION            3
+#define CONTROL_GAIN_UNITY         65536       /* gain is Q16 fixed point value, so unity means 0 dB */
+#define CONTROL_GAIN_MAX           (CONTROL_GAIN_UNITY * 4)
+#define CONTROL_METER_CHANNELS     8
+#define CONTROL_METER_FULL_SCALE   32768       /* levels are in 16 bits sample units */
+
+
+typedef struct control
+{
+    uint32_t          magic;
+    uint32_t          version;
+    volatile uint32_t gain;  /* 0 .. CONTROL_GAIN_MAX */
+    volatile uint32_t mute;  /* non-zero value mutes the stream */
+
+    /* levels of the last metering window (see metering option); sequence is odd while meters are being updated */
+    volatile uint32_t meter_sequence;
+    volatile uint32_t meter_channels;
+    volatile uint32_t meter_peak[CONTROL_METER_CHANNELS];  /* 0 .. CONTROL_METER_FULL_SCALE */
+    volatile uint32_t meter_rms[CONTROL_METER_CHANNELS];   /* 0 .. CONTROL_METER_FULL_SCALE */
+    volatile uint64_t meter_windows;                       /* amount of windows published so far */
+    volatile uint64_t meter_writer;                        /* process id << 32 | instance number of the plugin instance publishing meters; 0 if none */
+} control_t;
+
+
+typedef struct control_meters
+{
+    uint32_t channels;
+    uint32_t peak[CONTROL_METER_CHANNELS];
+    uint32_t rms[CONTROL_METER_CHANNELS];
+    uint64_t windows;
+} control_meters_t;
+
+
+/* taking a consistent snapshot of meters without blocking the plugin (sequence lock reader) */
+static inline void control_read_meters(control_t* control, control_meters_t* meters)
+{
+    uint32_t sequence;
+
+    do
+    {
+        while ((sequence = __atomic_load_n(&control->meter_sequence, __ATOMIC_ACQUIRE)) & 1);
+
+        meters->channels = (control->meter_channels < CONTROL_METER_CHANNELS ? control->meter_channels : CONTROL_METER_CHANNELS);
+        for (uint32_t c = 0; c < meters->channels; c++)
+        {
+            meters->peak[c] = control->meter_peak[c];
+            meters->rms[c]  = control->meter_rms[c];
+        }
+        meters->windows = control->meter_windows;
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    }
+    while (sequence != __atomic_load_n(&control->meter_sequence, __ATOMIC_RELAXED));
+}
+
+
+#endif  /* CONTROL_H */
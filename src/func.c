@@ -10,12 +10,23 @@
  * Author: gimesketvirtadieni at gmail dot com (Andrej Kislovskij)
  */
 
+#include <fcntl.h>       /* O_* constants */
+#include <signal.h>      /* kill(...) */
+#include <sys/mman.h>    /* mlock(...), shm_open(...) */
+#include <sys/stat.h>    /* fchmod(...), fstat(...) */
+#include <sys/syscall.h> /* SYS_gettid */
+#include <time.h>        /* clock_gettime(...) */
+#include <unistd.h>      /* ftruncate(...) */
 #include "slimplexor.h"
 
 
+/* mmap access is delivered through transfer callback when ALSA commits mmap areas, so mmap_rw emulation must stay disabled */
 const unsigned int supported_accesses[] =
 {
-    SND_PCM_ACCESS_RW_INTERLEAVED
+    SND_PCM_ACCESS_RW_INTERLEAVED,
+    SND_PCM_ACCESS_RW_NONINTERLEAVED,
+    SND_PCM_ACCESS_MMAP_INTERLEAVED,
+    SND_PCM_ACCESS_MMAP_NONINTERLEAVED
 };
 
 
@@ -34,6 +45,28 @@ const unsigned int supported_channels[] =
 };
 
 
+/* channels accepted when downmixing is enabled */
+const unsigned int supported_downmix_channels[] =
+{
+    1,
+    2,
+    6,
+    8
+};
+
+
+/* default matrices use ALSA channel order (FL FR RL RR FC LFE SL SR); LFE is dropped and result is normalized to avoid clipping */
+const channel_matrix_t default_channel_matrices[] =
+{
+    {1, {{16384},
+         {16384}}},
+    {6, {{6786, 0, 4799, 0, 4799, 0},
+         {0, 6786, 0, 4799, 4799, 0}}},
+    {8, {{5249, 0, 3711, 0, 3711, 0, 3711, 0},
+         {0, 5249, 0, 3711, 3711, 0, 0, 3711}}},
+};
+
+
 const unsigned int supported_rates[] =
 {
     8000,
@@ -52,6 +85,158 @@ const unsigned int supported_rates[] =
 };
 
 
+/* state handed over to a background drainer by close routine */
+typedef struct background_drain
+{
+    plugin_data_t            plugin_data;
+    unsigned int             grace_period;  /* milliseconds the stream may be continued by the next open */
+    unsigned short           busy;          /* drainer is writing to the destination device, so it can not be taken over */
+    unsigned short           parked;        /* stream may be continued without end of stream marker */
+    unsigned short           draining;      /* end of stream marker was written, so the device may be reused for a new stream */
+    unsigned short           reclaimed;
+    struct background_drain* next;
+} background_drain_t;
+
+
+/* keeps track of background drains so the plugin is not unloaded while they are still running */
+static pthread_mutex_t     background_drains_lock    = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t      background_drains_cond    = PTHREAD_COND_INITIALIZER;
+static unsigned int        background_drains_running = 0;
+
+/* drains which still own their destination device, so the next open can take it over instead of waiting for it */
+static background_drain_t* background_drains         = NULL;
+
+
+unsigned char* allocate_buffer(plugin_data_t* plugin_data, size_t size_in_bytes)
+{
+    void*  buffer    = NULL;
+    size_t alignment = CACHE_LINE_SIZE;
+
+    /* locks do not stack and munlock works on whole pages, so a locked buffer owns its pages and unlocking it can not unlock another buffer */
+    if (plugin_data->lock_memory)
+    {
+        alignment     = (size_t)sysconf(_SC_PAGESIZE);
+        size_in_bytes = (size_in_bytes + alignment - 1) & ~(alignment - 1);
+    }
+
+    /* buffer is aligned to cache line so conversion never splits a line with unrelated data */
+    if (posix_memalign(&buffer, alignment, size_in_bytes))
+    {
+        return NULL;
+    }
+
+    /* zeroing touches every page, so there are no page faults later while streaming */
+    memset(buffer, 0, size_in_bytes);
+
+    if (plugin_data->lock_memory && mlock(buffer, size_in_bytes) < 0)
+    {
+        LOG_WARNING("Could not lock buffer in memory (error=%s)", strerror(errno));
+    }
+
+    return (unsigned char*)buffer;
+}
+
+
+/* Q16 fixed point multiply with saturation over a contiguous run of samples */
+static inline void scale_samples(unsigned char* data, size_t sample_size, size_t samples, int32_t gain)
+{
+    if (sample_size == 4)
+    {
+        int32_t* values = (int32_t*)data;
+        for (size_t i = 0; i < samples; i++)
+        {
+            int64_t value = ((int64_t)values[i] * gain) >> 16;
+            values[i]     = (value > INT32_MAX ? INT32_MAX : (value < INT32_MIN ? INT32_MIN : value));
+        }
+    }
+    else if (sample_size == 2)
+    {
+        int16_t* values = (int16_t*)data;
+        for (size_t i = 0; i < samples; i++)
+        {
+            int64_t value = ((int64_t)values[i] * gain) >> 16;
+            values[i]     = (value > INT16_MAX ? INT16_MAX : (value < INT16_MIN ? INT16_MIN : value));
+        }
+    }
+}
+
+
+static inline void apply_gain(plugin_data_t* plugin_data, unsigned char* target_data, size_t target_sample_size, size_t frame_samples, snd_pcm_uframes_t frames)
+{
+    size_t            frame_size = target_sample_size * frame_samples;
+    snd_pcm_uframes_t f          = 0;
+
+    /* moving gain towards its target by one ramp step per frame; metadata channel is still zero, so it is scaled as well */
+    for (; f < frames && plugin_data->gain_current != plugin_data->gain_target; f++)
+    {
+        if (abs(plugin_data->gain_target - plugin_data->gain_current) <= plugin_data->gain_step)
+        {
+            plugin_data->gain_current = plugin_data->gain_target;
+        }
+        else
+        {
+            plugin_data->gain_current += (plugin_data->gain_target > plugin_data->gain_current ? plugin_data->gain_step : -plugin_data->gain_step);
+        }
+        scale_samples(target_data + f * frame_size, target_sample_size, frame_samples, plugin_data->gain_current);
+    }
+
+    /* once the ramp is over the rest of the frames is a single run with constant gain */
+    if (f < frames)
+    {
+        scale_samples(target_data + f * frame_size, target_sample_size, (frames - f) * frame_samples, plugin_data->gain_current);
+    }
+}
+
+
+/* meters are published with a sequence lock which allows a single writer, so only one plugin instance per volume control segment publishes them */
+int claim_meters(plugin_data_t* plugin_data)
+{
+    control_t* control = plugin_data->control;
+    uint64_t   writer;
+
+    if (!control)
+    {
+        return 0;
+    }
+
+    writer = __atomic_load_n(&control->meter_writer, __ATOMIC_ACQUIRE);
+    if (writer == plugin_data->meter_writer_id)
+    {
+        return 0;
+    }
+
+    /* writer which is gone without releasing the segment is replaced; its update might have been interrupted, so sequence is made even again */
+    if (writer && kill((pid_t)(writer >> 32), 0) < 0 && errno == ESRCH &&
+        __atomic_compare_exchange_n(&control->meter_writer, &writer, plugin_data->meter_writer_id, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        if (__atomic_load_n(&control->meter_sequence, __ATOMIC_RELAXED) & 1)
+        {
+            __atomic_fetch_add(&control->meter_sequence, 1, __ATOMIC_RELEASE);
+        }
+        LOG_INFO("Levels are published by this plugin instance as the previous writer is gone (process id=%u)", (unsigned int)(writer >> 32));
+        return 0;
+    }
+
+    writer = 0;
+    if (!__atomic_compare_exchange_n(&control->meter_writer, &writer, plugin_data->meter_writer_id, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        LOG_WARNING("Levels are not published as another plugin instance publishes them through the same volume control (process id=%u)", (unsigned int)(writer >> 32));
+        return -EBUSY;
+    }
+
+    return 0;
+}
+
+
+void close_control(control_t* control)
+{
+    if (control)
+    {
+        munmap(control, sizeof(control_t));
+    }
+}
+
+
 void close_destination_device(plugin_data_t* plugin_data)
 {
     /* making sure destination device handle was created; otherwise there is nothing to close */
@@ -71,193 +256,933 @@ void close_destination_device(plugin_data_t* plugin_data)
         LOG_INFO("Destination device was closed");
     }
 
+    close_secondary_destinations(plugin_data);
+
     if (plugin_data->dst_buffer)
     {
-        free(plugin_data->dst_buffer);
+        free_buffer(plugin_data, plugin_data->dst_buffer, plugin_data->dst_buffer_bytes);
         plugin_data->dst_buffer = NULL;
     }
+    if (plugin_data->xrun_buffer)
+    {
+        free_buffer(plugin_data, plugin_data->xrun_buffer, plugin_data->xrun_buffer_bytes);
+        plugin_data->xrun_buffer = NULL;
+    }
 
     plugin_data->dst_pcm_handle = NULL;
 }
 
 
-void copy_frames(plugin_data_t* plugin_data, unsigned char* pcm_data, snd_pcm_uframes_t frames)
+void close_secondary_destinations(plugin_data_t* plugin_data)
 {
-    size_t         sample_size        = (snd_pcm_format_physical_width(plugin_data->src_format) >> 3);
-    size_t         target_sample_size = (snd_pcm_format_physical_width(plugin_data->dst_format) >> 3);
-    size_t         target_frame_size  = target_sample_size * (plugin_data->alsa_data.channels + 1);
-    size_t         size_difference    = target_sample_size - sample_size;
-    unsigned char* target_data        = plugin_data->dst_buffer + plugin_data->dst_buffer_current * target_frame_size;
-
-    /* resetting target buffer to make sure it is not filled with junk */
-    memset(target_data, 0, frames * target_frame_size);
-
-    /* going through frame-by-frame */
-    for (unsigned int f = 0; f < frames; f++)
+    for (unsigned int i = 0; i < plugin_data->secondaries_size; i++)
     {
-        /* going through channel-by-channel */
-        /* TODO: support is required for source channel != (target channel + 1) */
-        for (unsigned int c = 0; c < plugin_data->alsa_data.channels; c++)
+        secondary_destination_t* secondary = &plugin_data->secondaries[i];
+
+        if (secondary->pcm_handle)
         {
-            copy_sample(plugin_data, pcm_data, sample_size, target_data + size_difference);
+            snd_pcm_close(secondary->pcm_handle);
+            secondary->pcm_handle = NULL;
 
-            /* skipping to the next sample representing the next channel */
-            pcm_data    += sample_size;
-            target_data += target_sample_size;
+            LOG_INFO("Secondary destination device %s was closed (dropped frames=%lu)", secondary->device, secondary->dropped_frames);
         }
+        if (secondary->backlog)
+        {
+            free_buffer(plugin_data, secondary->backlog, secondary->backlog_bytes);
+            secondary->backlog = NULL;
+        }
+    }
+}
 
-        /* target frame contains one extra channel for control data */
-        target_data += target_sample_size;
 
-        /* marking frame as containing data in the last byte of the last channel */
-        *(target_data - 1) = DATA_MARKER;
+/* format is handled once per channel instead of once per sample, so frame loops have no branches */
+/* samples are left aligned in the target; strides are in samples */
+static inline void convert_channel(snd_pcm_format_t format, const unsigned char* source, size_t source_stride, unsigned char* target, size_t target_stride, size_t target_sample_size, snd_pcm_uframes_t frames)
+{
+    if (target_sample_size == 4)
+    {
+        int32_t* target_samples = (int32_t*)target;
+        switch (format)
+        {
+            case SND_PCM_FORMAT_S8:  /* TODO: still requires testing */
+                for (snd_pcm_uframes_t f = 0; f < frames; f++)
+                {
+                    target_samples[f * target_stride] = (int32_t)((uint32_t)((const uint8_t*)source)[f * source_stride] << 24);
+                }
+                break;
+            case SND_PCM_FORMAT_S16_LE:
+                for (snd_pcm_uframes_t f = 0; f < frames; f++)
+                {
+                    target_samples[f * target_stride] = (int32_t)((uint32_t)((const uint16_t*)source)[f * source_stride] << 16);
+                }
+                break;
+            case SND_PCM_FORMAT_S24_LE:
+                for (snd_pcm_uframes_t f = 0; f < frames; f++)
+                {
+                    target_samples[f * target_stride] = (int32_t)(((const uint32_t*)source)[f * source_stride] << 8);
+                }
+                break;
+            case SND_PCM_FORMAT_S32_LE:
+                for (snd_pcm_uframes_t f = 0; f < frames; f++)
+                {
+                    target_samples[f * target_stride] = ((const int32_t*)source)[f * source_stride];
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    else if (target_sample_size == 2)
+    {
+        int16_t* target_samples = (int16_t*)target;
+        switch (format)
+        {
+            case SND_PCM_FORMAT_S8:  /* TODO: still requires testing */
+                for (snd_pcm_uframes_t f = 0; f < frames; f++)
+                {
+                    target_samples[f * target_stride] = (int16_t)((uint16_t)((const uint8_t*)source)[f * source_stride] << 8);
+                }
+                break;
+            case SND_PCM_FORMAT_S16_LE:
+                for (snd_pcm_uframes_t f = 0; f < frames; f++)
+                {
+                    target_samples[f * target_stride] = ((const int16_t*)source)[f * source_stride];
+                }
+                break;
+            default:
+                break;
+        }
     }
-
-    /* increasing pointer of the target buffer */
-    plugin_data->dst_buffer_current += frames;
 }
 
 
-void copy_sample(plugin_data_t* plugin_data, unsigned char* source_sample, size_t source_sample_size, unsigned char* target_sample)
+/* source channels are converted into a block of left aligned samples first, then every output is accumulated channel by channel */
+static inline void mix_frames(channel_matrix_t* matrix, snd_pcm_format_t format, unsigned char** source_samples, size_t* source_strides, size_t sample_size,
+                              unsigned char* target_data, size_t target_stride, size_t target_sample_size, snd_pcm_uframes_t frames)
 {
-    switch (plugin_data->src_format)
+    int32_t samples[MAX_SOURCE_CHANNELS][MIX_BLOCK_SIZE];
+    int64_t values[MIX_BLOCK_SIZE];
+    int32_t mixed[MIX_BLOCK_SIZE];
+
+    for (snd_pcm_uframes_t done = 0; done < frames; done += MIX_BLOCK_SIZE)
     {
-        case SND_PCM_FORMAT_S8:  /* TODO: still requires testing */
-        case SND_PCM_FORMAT_S16_LE:
-        case SND_PCM_FORMAT_S32_LE:
-            for (unsigned int s = 0; s < source_sample_size; s++)
+        snd_pcm_uframes_t block = (frames - done < MIX_BLOCK_SIZE ? frames - done : MIX_BLOCK_SIZE);
+
+        for (unsigned int c = 0; c < matrix->channels; c++)
+        {
+            convert_channel(format, source_samples[c] + done * source_strides[c] * sample_size, source_strides[c], (unsigned char*)samples[c], 1, sizeof(int32_t), block);
+        }
+
+        /* Q14 multiply-accumulate with saturation */
+        for (unsigned int o = 0; o < OUTPUT_CHANNELS; o++)
+        {
+            memset(values, 0, block * sizeof(int64_t));
+            for (unsigned int c = 0; c < matrix->channels; c++)
             {
-                target_sample[s] = source_sample[s];
+                int32_t coefficient = matrix->coefficients[o][c];
+                for (snd_pcm_uframes_t f = 0; f < block; f++)
+                {
+                    values[f] += (int64_t)samples[c][f] * coefficient;
+                }
             }
-            break;
-        case SND_PCM_FORMAT_S24_LE:
-            for (unsigned int s = 0; s < 3; s++)
+
+            /* saturating into a contiguous block first keeps the strided store a plain copy */
+            for (snd_pcm_uframes_t f = 0; f < block; f++)
             {
-                target_sample[s + 1] = source_sample[s];
+                int64_t value = values[f] >> 14;
+                mixed[f]      = (value > INT32_MAX ? INT32_MAX : (value < INT32_MIN ? INT32_MIN : value));
             }
-            break;
-        default:
-            break;
+            if (target_sample_size == 4)
+            {
+                int32_t* target_samples = (int32_t*)target_data + done * target_stride + o;
+                for (snd_pcm_uframes_t f = 0; f < block; f++)
+                {
+                    target_samples[f * target_stride] = mixed[f];
+                }
+            }
+            else if (target_sample_size == 2)
+            {
+                int16_t* target_samples = (int16_t*)target_data + done * target_stride + o;
+                for (snd_pcm_uframes_t f = 0; f < block; f++)
+                {
+                    target_samples[f * target_stride] = (int16_t)(mixed[f] >> 16);
+                }
+            }
+        }
     }
 }
 
 
-const char* log_level_to_string(unsigned int log_level)
+/* accumulating peak and sum of squares per channel in 16 bits units, which is precise enough for metering */
+static inline void update_meters(plugin_data_t* plugin_data, unsigned char* target_data, size_t target_sample_size, size_t frame_samples, unsigned int channels, snd_pcm_uframes_t frames)
 {
-    switch (log_level) {
-        case 0:
-            return "NONE";
-        case 1:
-            return "ERROR";
-        case 2:
-            return "WARNING";
-        case 3:
-            return "INFO";
-        case 4:
-            return "DEBUG";
-    }
+    for (unsigned int c = 0; c < channels; c++)
+    {
+        uint32_t peak = plugin_data->meter_peak[c];
+        uint64_t sum  = plugin_data->meter_sum[c];
 
-    /* this should never happen */
-    return "UNKNOWN";
+        /* level fits 16 bits, so its square fits 32 bits */
+        if (target_sample_size == 4)
+        {
+            int32_t* samples = (int32_t*)target_data + c;
+            for (snd_pcm_uframes_t f = 0; f < frames; f++)
+            {
+                int32_t  value = samples[f * frame_samples] >> 16;
+                uint32_t level = (uint32_t)(value < 0 ? -value : value);
+
+                peak = (peak < level ? level : peak);
+                sum += level * level;
+            }
+        }
+        else if (target_sample_size == 2)
+        {
+            int16_t* samples = (int16_t*)target_data + c;
+            for (snd_pcm_uframes_t f = 0; f < frames; f++)
+            {
+                int32_t  value = samples[f * frame_samples];
+                uint32_t level = (uint32_t)(value < 0 ? -value : value);
+
+                peak = (peak < level ? level : peak);
+                sum += level * level;
+            }
+        }
+
+        plugin_data->meter_peak[c] = peak;
+        plugin_data->meter_sum[c]  = sum;
+    }
+    plugin_data->meter_frames += frames;
 }
 
 
-int open_destination_device(plugin_data_t* plugin_data)
+/* levels of the last window are spread over spare bytes of the metadata channel, one channel per frame */
+static inline void encode_meters(plugin_data_t* plugin_data, unsigned char* metadata, size_t target_sample_size, unsigned int channels)
 {
-    int                  error     = 0;
-    snd_pcm_hw_params_t* hw_params = NULL;
+    unsigned int channel = plugin_data->meter_channel;
 
-    /* opening the target device */
-    if (!error)
+    if (target_sample_size == 4)
     {
-        if ((error = snd_pcm_open(&plugin_data->dst_pcm_handle, plugin_data->dst_device, SND_PCM_STREAM_PLAYBACK, 0)) < 0)
-        {
-            LOG_ERROR("Could not open destination device: %s", snd_strerror(error));
-        }
+        metadata[0] = (unsigned char)channel;
+        metadata[1] = (unsigned char)(plugin_data->meter_last_peak[channel] > 32767 ? 255 : plugin_data->meter_last_peak[channel] >> 7);
+        metadata[2] = (unsigned char)(plugin_data->meter_last_rms[channel] > 32767 ? 255 : plugin_data->meter_last_rms[channel] >> 7);
     }
-
-    /* allocating hardware parameters object and fill it with default values */
-    if (!error)
+    else
     {
-        if ((error = snd_pcm_hw_params_malloc(&hw_params)) < 0)
+        /* S16 metadata channel has only one spare byte, so it carries peak of the loudest channel */
+        uint32_t peak = 0;
+        for (unsigned int c = 0; c < channels; c++)
         {
-            LOG_ERROR("Could not allocate HW parameters: %s", snd_strerror(error));
+            peak = (peak < plugin_data->meter_last_peak[c] ? plugin_data->meter_last_peak[c] : peak);
         }
+        metadata[0] = (unsigned char)(peak > 32767 ? 255 : peak >> 7);
     }
-    if (!error)
+
+    plugin_data->meter_channel = (channel + 1 < channels ? channel + 1 : 0);
+}
+
+
+void copy_frames(plugin_data_t* plugin_data, const snd_pcm_channel_area_t* areas, snd_pcm_uframes_t offset, snd_pcm_uframes_t frames)
+{
+    size_t         sample_size        = (snd_pcm_format_physical_width(plugin_data->src_format) >> 3);
+    size_t         target_sample_size = (snd_pcm_format_physical_width(plugin_data->dst_format) >> 3);
+    size_t         target_frame_size  = target_sample_size * plugin_data->dst_channels;
+    unsigned char* target_data        = plugin_data->dst_buffer + plugin_data->dst_buffer_current * target_frame_size;
+    unsigned int   channels           = plugin_data->alsa_data.channels;
+    unsigned int   meter_channels     = (plugin_data->dst_channels - 1 < MAX_SOURCE_CHANNELS ? plugin_data->dst_channels - 1 : MAX_SOURCE_CHANNELS);
+    unsigned char* source_samples[MAX_SOURCE_CHANNELS];
+    size_t         source_strides[MAX_SOURCE_CHANNELS];
+
+    /* every channel is read through its own area, so interleaved and non-interleaved buffers are converted the same way */
+    for (unsigned int c = 0; c < channels; c++)
     {
-        if ((error = snd_pcm_hw_params_any(plugin_data->dst_pcm_handle, hw_params)) < 0)
-        {
-            LOG_ERROR("Could not fill HW parameters with defaults: %s", snd_strerror(error));
-        }
+        source_samples[c] = (unsigned char*)areas[c].addr + ((areas[c].first + areas[c].step * offset) >> 3);
+        source_strides[c] = areas[c].step / (sample_size << 3);
     }
 
-    /* setting target device parameters */
-    if (!error)
+    /* resetting target buffer to make sure it is not filled with junk */
+    memset(target_data, 0, frames * target_frame_size);
+
+    /* converting channel by channel; channels are mapped while converting, so there is no need for an extra route plugin */
+    if (plugin_data->channel_matrix)
     {
-        if ((error = snd_pcm_hw_params_set_access(plugin_data->dst_pcm_handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
-        {
-            LOG_ERROR("Could not set destination device access mode: %s", snd_strerror(error));
-        }
+        mix_frames(plugin_data->channel_matrix, plugin_data->src_format, source_samples, source_strides, sample_size, target_data, plugin_data->dst_channels, target_sample_size, frames);
     }
-    if (!error)
+    else
     {
-        if ((error = snd_pcm_hw_params_set_format(plugin_data->dst_pcm_handle, hw_params, plugin_data->dst_format)) < 0)
+        for (unsigned int c = 0; c < channels; c++)
         {
-            LOG_ERROR("Could not set destination device format: %s %d", snd_strerror(error), plugin_data->dst_format);
+            convert_channel(plugin_data->src_format, source_samples[c], source_strides[c], target_data + c * target_sample_size, plugin_data->dst_channels, target_sample_size, frames);
         }
     }
-    if (!error)
+
+    /* gain is applied while converted frames are still in cache unless it is unity */
+    update_gain(plugin_data);
+    if (plugin_data->gain_current != CONTROL_GAIN_UNITY || plugin_data->gain_target != CONTROL_GAIN_UNITY)
     {
-        if ((error = snd_pcm_hw_params_set_channels(plugin_data->dst_pcm_handle, hw_params, plugin_data->alsa_data.channels + 1)) < 0)
-        {
-            LOG_ERROR("Could not set amount of channels for destination device: %s", snd_strerror(error));
-        }
+        apply_gain(plugin_data, target_data, target_sample_size, plugin_data->dst_channels, frames);
     }
-    if (!error)
+
+    /* frames are processed up to the end of metering window, so levels are published exactly at window boundaries */
+    for (snd_pcm_uframes_t f = 0; f < frames;)
     {
-        if ((error = snd_pcm_hw_params_set_rate(plugin_data->dst_pcm_handle, hw_params, plugin_data->alsa_data.rate, 0)) < 0)
+        snd_pcm_uframes_t run = frames - f;
+
+        /* levels are measured after gain */
+        if (plugin_data->metering)
         {
-            LOG_ERROR("Could not set sample rate for destination device: %s", snd_strerror(error));
+            snd_pcm_uframes_t window_left = (plugin_data->meter_window > plugin_data->meter_frames ? plugin_data->meter_window - plugin_data->meter_frames : 1);
+            run = (run < window_left ? run : window_left);
+            update_meters(plugin_data, target_data + f * target_frame_size, target_sample_size, plugin_data->dst_channels, meter_channels, run);
         }
-    }
-    if (!error)
-    {
-        if ((error = snd_pcm_hw_params_set_period_size(plugin_data->dst_pcm_handle, hw_params, plugin_data->dst_period_size, 0)) < 0)
+
+        for (snd_pcm_uframes_t i = f; i < f + run; i++)
         {
-            LOG_ERROR("Could not set period size for destination device: %s", snd_strerror(error));
+            unsigned char* metadata = target_data + (i + 1) * target_frame_size - target_sample_size;
+
+            if (plugin_data->metering && i == f + run - 1 && plugin_data->meter_frames >= plugin_data->meter_window)
+            {
+                publish_meters(plugin_data);
+            }
+
+            /* marking frame as containing data in the last byte of the last channel */
+            metadata[target_sample_size - 1] = DATA_MARKER;
+
+            if (plugin_data->meter_metadata)
+            {
+                encode_meters(plugin_data, metadata, target_sample_size, meter_channels);
+            }
         }
+        f += run;
     }
-    if (!error)
+
+    /* increasing pointer of the target buffer */
+    __atomic_store_n(&plugin_data->dst_buffer_current, plugin_data->dst_buffer_current + frames, __ATOMIC_RELAXED);
+}
+
+
+int decode_stream_descriptor(const unsigned char* descriptor, stream_descriptor_t* stream_descriptor)
+{
+    unsigned char checksum = 0;
+
+    for (unsigned int i = 0; i < DESCRIPTOR_SIZE - 1; i++)
     {
-        if ((error = snd_pcm_hw_params_set_periods(plugin_data->dst_pcm_handle, hw_params, plugin_data->dst_periods, 0)) < 0)
-        {
-            LOG_ERROR("Could not set amount of periods for destination device: %s", snd_strerror(error));
-        }
+        checksum += descriptor[i];
     }
 
-#if SND_LIB_VERSION >= 0x010009
-    /* disabling ALSA resampling */
-    if (!error)
+    /* newer descriptors may be longer, but they keep the fields below in place */
+    if (descriptor[0] < 1 || descriptor[1] < DESCRIPTOR_SIZE || checksum != descriptor[DESCRIPTOR_SIZE - 1])
     {
-        if ((error = snd_pcm_hw_params_set_rate_resample(plugin_data->dst_pcm_handle, hw_params, 0)) < 0)
-        {
-            LOG_ERROR("Could not disable ALSA resampling: %s", snd_strerror(error));
-        }
+        return -EINVAL;
     }
-#endif
 
-    /* saving hardware parameters for target device */
-    if (!error)
+    stream_descriptor->version           = descriptor[0];
+    stream_descriptor->format            = (snd_pcm_format_t)(descriptor[2] | descriptor[3] << 8);
+    stream_descriptor->bits              = descriptor[4];
+    stream_descriptor->channels          = descriptor[5];
+    stream_descriptor->dst_channels      = descriptor[6];
+    stream_descriptor->flags             = descriptor[7];
+    stream_descriptor->rate              = descriptor[8] | descriptor[9] << 8 | descriptor[10] << 16 | (unsigned int)descriptor[11] << 24;
+    stream_descriptor->plugin_version[0] = descriptor[12];
+    stream_descriptor->plugin_version[1] = descriptor[13];
+    stream_descriptor->plugin_version[2] = descriptor[14];
+
+    return 0;
+}
+
+
+void drain_destination_device(plugin_data_t* plugin_data)
+{
+    /* if there PCM data transfer was actually started then marking the end of stream and draining buffer */
+    if (!plugin_data->dst_pcm_handle || !plugin_data->transfer_started)
     {
-        if ((error = snd_pcm_hw_params(plugin_data->dst_pcm_handle, hw_params)) < 0)
-        {
-            LOG_ERROR("Could set hardware parameters: %s", snd_strerror(error));
-        }
+        return;
     }
-    if (!hw_params)
+
+    write_stream_marker(plugin_data, END_OF_STREAM_MARKER);
+
+    int error;
+    if ((error = snd_pcm_drain(plugin_data->dst_pcm_handle)) < 0)
     {
-        snd_pcm_hw_params_free(hw_params);
+        LOG_WARNING("Error while draining target device: %s", snd_strerror(error));
+    }
+    plugin_data->transfer_started = 0;
+
+    /* secondary destinations are drained after the primary one so they can not delay it */
+    drain_secondary_destinations(plugin_data);
+}
+
+
+/* must be called while holding background_drains_lock */
+static void remove_background_drain(background_drain_t* drain)
+{
+    for (background_drain_t** current = &background_drains; *current; current = &(*current)->next)
+    {
+        if (*current == drain)
+        {
+            *current = drain->next;
+            break;
+        }
+    }
+}
+
+
+/* loopback is kept running while a stream is parked, so there is no xrun if the stream is continued */
+static int is_silence_due(plugin_data_t* plugin_data)
+{
+    snd_pcm_sframes_t delay = 0;
+
+    return snd_pcm_state(plugin_data->dst_pcm_handle) == SND_PCM_STATE_RUNNING &&
+           snd_pcm_delay(plugin_data->dst_pcm_handle, &delay) == 0 &&
+           delay < (snd_pcm_sframes_t)plugin_data->dst_period_size * 2;
+}
+
+
+static void write_silence(plugin_data_t* plugin_data)
+{
+    snd_pcm_sframes_t result            = 0;
+    size_t            target_frame_size = (snd_pcm_format_physical_width(plugin_data->dst_format) >> 3) * plugin_data->dst_channels;
+
+    /* one period of silence; it goes through the same write path, so secondaries and dump file get it as well */
+    memset(plugin_data->dst_buffer, 0, plugin_data->dst_buffer_size * target_frame_size);
+    for (snd_pcm_uframes_t i = 0; i < plugin_data->dst_buffer_size; i++)
+    {
+        plugin_data->dst_buffer[(i + 1) * target_frame_size - 1] = SILENCE_MARKER;
+    }
+    for (__atomic_store_n(&plugin_data->dst_buffer_current, plugin_data->dst_buffer_size, __ATOMIC_RELAXED); plugin_data->dst_buffer_current > 0 && result >= 0;)
+    {
+        result = write_to_dst(plugin_data);
+    }
+}
+
+
+static void* background_drain_thread(void* arg)
+{
+    background_drain_t* drain      = (background_drain_t*)arg;
+    plugin_data_t*      drain_data = &drain->plugin_data;
+    snd_pcm_sframes_t   result     = 0;
+    struct timespec     deadline;
+
+    /* drainer logs and delivers data to the loopback as well, so it runs with the same logging and real-time settings */
+    set_logging(drain_data);
+    drain_data->rt_thread_set = 0;
+    set_realtime_scheduling(drain_data);
+
+    if (drain->parked)
+    {
+        /* parked stream must not keep pending frames as it may be continued by another plugin instance */
+        while (drain_data->dst_buffer_current > 0 && result >= 0)
+        {
+            result = write_to_dst(drain_data);
+        }
+
+        /* waiting until the stream is either continued, expired by another open or grace period is over */
+        unsigned long long expires_at = get_time_us() + drain->grace_period * 1000ULL;
+        unsigned int       period_ms  = drain_data->dst_period_size * 1000 / drain_data->alsa_data.rate;
+        pthread_mutex_lock(&background_drains_lock);
+        drain->busy = 0;
+        pthread_cond_broadcast(&background_drains_cond);
+        while (!drain->reclaimed && drain->parked)
+        {
+            unsigned long long now = get_time_us();
+            if (now >= expires_at)
+            {
+                break;
+            }
+
+            /* marked silence is written without holding the lock; busy flag keeps the device from being taken over meanwhile */
+            if (is_silence_due(drain_data))
+            {
+                drain->busy = 1;
+                pthread_mutex_unlock(&background_drains_lock);
+                write_silence(drain_data);
+                pthread_mutex_lock(&background_drains_lock);
+                drain->busy = 0;
+                pthread_cond_broadcast(&background_drains_cond);
+                continue;
+            }
+
+            /* loopback is checked twice per period */
+            unsigned long long wait_ms = (expires_at - now + 999) / 1000;
+            get_deadline(&deadline, (wait_ms < period_ms / 2 ? wait_ms : (period_ms / 2 ? period_ms / 2 : 1)));
+            pthread_cond_timedwait(&background_drains_cond, &background_drains_lock, &deadline);
+        }
+        drain->busy   = !drain->reclaimed;
+        drain->parked = 0;
+        pthread_mutex_unlock(&background_drains_lock);
+    }
+
+    /* destination device is owned by another plugin instance if the stream was continued */
+    if (!drain->reclaimed)
+    {
+        /* end of stream is marked straight away, then the device may be reused by the next open while its buffer plays out */
+        write_stream_marker(drain_data, END_OF_STREAM_MARKER);
+        drain_data->transfer_started = 0;
+
+        pthread_mutex_lock(&background_drains_lock);
+        drain->busy     = 0;
+        drain->draining = 1;
+        pthread_cond_broadcast(&background_drains_cond);
+
+        /* polling instead of snd_pcm_drain, so the device can be handed over before its buffer is empty */
+        while (!drain->reclaimed)
+        {
+            snd_pcm_sframes_t delay = 0;
+            snd_pcm_state_t   state = snd_pcm_state(drain_data->dst_pcm_handle);
+
+            /* short streams may have not reached start threshold */
+            if (state == SND_PCM_STATE_PREPARED && snd_pcm_start(drain_data->dst_pcm_handle) == 0)
+            {
+                state = SND_PCM_STATE_RUNNING;
+            }
+            if (state != SND_PCM_STATE_RUNNING || snd_pcm_delay(drain_data->dst_pcm_handle, &delay) < 0 || delay <= 0)
+            {
+                break;
+            }
+
+            unsigned long long delay_ms = (unsigned long long)delay * 1000 / drain_data->alsa_data.rate;
+            get_deadline(&deadline, (delay_ms < 1 ? 1 : (delay_ms > 10 ? 10 : delay_ms)));
+            pthread_cond_timedwait(&background_drains_cond, &background_drains_lock, &deadline);
+        }
+
+        /* device can not be taken over from now on */
+        remove_background_drain(drain);
+        pthread_mutex_unlock(&background_drains_lock);
+    }
+    if (!drain->reclaimed)
+    {
+        drain_secondary_destinations(drain_data);
+        close_destination_device(drain_data);
+
+        LOG_DEBUG("Background drain is complete");
+    }
+    free(drain);
+
+    pthread_mutex_lock(&background_drains_lock);
+    background_drains_running--;
+    pthread_cond_broadcast(&background_drains_cond);
+    pthread_mutex_unlock(&background_drains_lock);
+
+    return NULL;
+}
+
+
+int drain_destination_device_in_background(plugin_data_t* plugin_data, unsigned int grace_period)
+{
+    int                 error = 0;
+    background_drain_t* drain = NULL;
+    pthread_attr_t      attr;
+    pthread_t           thread;
+
+    /* drainer gets its own copy of the state so it does not depend on the plugin instance being closed */
+    drain = calloc(1, sizeof(background_drain_t));
+    if (!drain)
+    {
+        error = -ENOMEM;
+        LOG_ERROR("Could not allocate memory for background drain (requested %lu bytes)", sizeof(background_drain_t));
+    }
+    if (!error)
+    {
+        drain->plugin_data  = *plugin_data;
+        drain->grace_period = grace_period;
+        drain->parked       = (grace_period > 0);
+        drain->busy         = 1;
+
+        pthread_mutex_lock(&background_drains_lock);
+        background_drains_running++;
+
+        /* only the latest closed stream may be continued, so streams parked before are expired */
+        for (background_drain_t* current = background_drains; current; current = current->next)
+        {
+            current->parked = 0;
+        }
+
+        /* drain is registered before returning so the very next open can take its device over */
+        drain->next       = background_drains;
+        background_drains = drain;
+        pthread_cond_broadcast(&background_drains_cond);
+        pthread_mutex_unlock(&background_drains_lock);
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if ((error = -pthread_create(&thread, &attr, background_drain_thread, drain)) < 0)
+        {
+            LOG_WARNING("Could not start background drain: %s", strerror(-error));
+
+            pthread_mutex_lock(&background_drains_lock);
+            remove_background_drain(drain);
+            background_drains_running--;
+            pthread_mutex_unlock(&background_drains_lock);
+
+            free(drain);
+        }
+        pthread_attr_destroy(&attr);
+    }
+
+    /* destination device and its buffer are owned by the drainer from now on */
+    if (!error)
+    {
+        plugin_data->dst_pcm_handle     = NULL;
+        plugin_data->dst_buffer         = NULL;
+        plugin_data->xrun_buffer        = NULL;
+        plugin_data->secondaries_size   = 0;
+        plugin_data->pcm_dump_file      = NULL;
+        plugin_data->pcm_dump_info_file = NULL;
+        plugin_data->transfer_started   = 0;
+    }
+
+    return error;
+}
+
+
+void drain_secondary_destinations(plugin_data_t* plugin_data)
+{
+    for (unsigned int i = 0; i < plugin_data->secondaries_size; i++)
+    {
+        secondary_destination_t* secondary = &plugin_data->secondaries[i];
+        snd_pcm_sframes_t        result    = 0;
+
+        if (!secondary->pcm_handle)
+        {
+            continue;
+        }
+
+        /* switching to blocking mode to write the rest of backlog */
+        snd_pcm_nonblock(secondary->pcm_handle, 0);
+        if (secondary->backlog_current > 0)
+        {
+            if ((result = snd_pcm_writei(secondary->pcm_handle, secondary->backlog, secondary->backlog_current)) < 0)
+            {
+                LOG_WARNING("Error while writing to secondary destination device %s: %s", secondary->device, snd_strerror(result));
+            }
+            secondary->backlog_current = 0;
+        }
+        if (result >= 0 && (result = snd_pcm_drain(secondary->pcm_handle)) < 0)
+        {
+            LOG_WARNING("Error while draining secondary destination device %s: %s", secondary->device, snd_strerror(result));
+        }
+    }
+}
+
+
+/*
+ * Descriptor layout (multi-byte values are little endian):
+ *   0     descriptor version
+ *   1     descriptor size in bytes
+ *   2-3   original format (snd_pcm_format_t)
+ *   4     significant bits of the original format
+ *   5     original amount of channels
+ *   6     PCM channels in the loopback (metadata channel is not counted)
+ *   7     flags (DESCRIPTOR_NATIVE_WIDTH, DESCRIPTOR_DOWNMIX, DESCRIPTOR_METER_METADATA)
+ *   8-11  sampling rate
+ *   12-14 plugin version (major, minor, patch)
+ *   15    checksum: sum of bytes 0-14 modulo 256
+ */
+void encode_stream_descriptor(plugin_data_t* plugin_data, unsigned char* descriptor)
+{
+    unsigned int rate  = plugin_data->alsa_data.rate;
+    unsigned int flags = 0;
+
+    flags |= (plugin_data->dst_format == NATIVE_WIDTH_FORMAT ? DESCRIPTOR_NATIVE_WIDTH : 0);
+    flags |= (plugin_data->channel_matrix ? DESCRIPTOR_DOWNMIX : 0);
+    flags |= (plugin_data->meter_metadata ? DESCRIPTOR_METER_METADATA : 0);
+
+    descriptor[0]  = DESCRIPTOR_VERSION;
+    descriptor[1]  = DESCRIPTOR_SIZE;
+    descriptor[2]  = (unsigned char)(plugin_data->src_format);
+    descriptor[3]  = (unsigned char)(plugin_data->src_format >> 8);
+    descriptor[4]  = (unsigned char)snd_pcm_format_width(plugin_data->src_format);
+    descriptor[5]  = (unsigned char)plugin_data->alsa_data.channels;
+    descriptor[6]  = (unsigned char)(plugin_data->dst_channels - 1);
+    descriptor[7]  = (unsigned char)flags;
+    descriptor[8]  = (unsigned char)(rate);
+    descriptor[9]  = (unsigned char)(rate >> 8);
+    descriptor[10] = (unsigned char)(rate >> 16);
+    descriptor[11] = (unsigned char)(rate >> 24);
+    descriptor[12] = VERSION_MAJOR;
+    descriptor[13] = VERSION_MINOR;
+    descriptor[14] = VERSION_PATCH;
+
+    descriptor[DESCRIPTOR_SIZE - 1] = 0;
+    for (unsigned int i = 0; i < DESCRIPTOR_SIZE - 1; i++)
+    {
+        descriptor[DESCRIPTOR_SIZE - 1] += descriptor[i];
+    }
+}
+
+
+void free_buffer(plugin_data_t* plugin_data, unsigned char* buffer, size_t size_in_bytes)
+{
+    /* locked buffers are page aligned and rounded up to whole pages (see allocate_buffer) */
+    if (plugin_data->lock_memory)
+    {
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        munlock(buffer, (size_in_bytes + page_size - 1) & ~(page_size - 1));
+    }
+    free(buffer);
+}
+
+
+void get_deadline(struct timespec* deadline, unsigned int milliseconds)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec  += milliseconds / 1000;
+    deadline->tv_nsec += (milliseconds % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+
+unsigned long long get_time_us()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (unsigned long long)now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+
+int is_write_due(plugin_data_t* plugin_data)
+{
+    /* without coalescing every transfer is written straight away */
+    if (!plugin_data->coalesce_latency)
+    {
+        return 1;
+    }
+
+    return plugin_data->dst_buffer_current >= plugin_data->coalesce_watermark ||
+           plugin_data->dst_buffer_current >= plugin_data->dst_buffer_size ||
+           get_time_us() - plugin_data->coalesce_started_at >= plugin_data->coalesce_latency * 1000ULL;
+}
+
+
+void init_channel_matrices(plugin_data_t* plugin_data)
+{
+    for (unsigned int i = 0; i < ARRAY_SIZE(default_channel_matrices) && i < ARRAY_SIZE(plugin_data->channel_matrices); i++)
+    {
+        plugin_data->channel_matrices[i] = default_channel_matrices[i];
+    }
+}
+
+
+const char* log_level_to_string(unsigned int log_level)
+{
+    switch (log_level) {
+        case 0:
+            return "NONE";
+        case 1:
+            return "ERROR";
+        case 2:
+            return "WARNING";
+        case 3:
+            return "INFO";
+        case 4:
+            return "DEBUG";
+    }
+
+    /* this should never happen */
+    return "UNKNOWN";
+}
+
+
+control_t* open_control(const char* name)
+{
+    control_t*  control = NULL;
+    int         fd;
+    int         created = 0;
+    struct stat st;
+
+    /* segment is created by whoever comes first, plugin or controlling application; only the creator initializes it */
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0660)) >= 0)
+    {
+        /* group members may control volume regardless of umask, others may not access the segment at all */
+        created = 1;
+        fchmod(fd, 0660);
+    }
+    else if (errno == EEXIST)
+    {
+        fd = shm_open(name, O_RDWR, 0);
+    }
+    if (fd < 0)
+    {
+        LOG_ERROR("Could not open shared memory control (error=%s, name=%s)", strerror(errno), name);
+        return NULL;
+    }
+
+    /* segment is sized by its creator; a smaller segment was created by an older version and is extended, fields added since then are zero filled */
+    for (unsigned int i = 0; !created && fstat(fd, &st) == 0 && !st.st_size && i < CONTROL_INIT_TIMEOUT_MS; i++)
+    {
+        usleep(1000);
+    }
+    if ((created || (fstat(fd, &st) == 0 && st.st_size < (off_t)sizeof(control_t))) && ftruncate(fd, sizeof(control_t)) < 0)
+    {
+        LOG_ERROR("Could not resize shared memory control (error=%s, name=%s)", strerror(errno), name);
+    }
+    else if ((control = mmap(NULL, sizeof(control_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        LOG_ERROR("Could not map shared memory control (error=%s, name=%s)", strerror(errno), name);
+        control = NULL;
+    }
+    close(fd);
+
+    /* magic is published last, so other openers never see a partially initialized segment */
+    if (control && created)
+    {
+        control->gain    = CONTROL_GAIN_UNITY;
+        control->mute    = 0;
+        control->version = CONTROL_VERSION;
+        __atomic_store_n(&control->magic, CONTROL_MAGIC, __ATOMIC_RELEASE);
+    }
+    else if (control)
+    {
+        for (unsigned int i = 0; __atomic_load_n(&control->magic, __ATOMIC_ACQUIRE) != CONTROL_MAGIC && i < CONTROL_INIT_TIMEOUT_MS; i++)
+        {
+            usleep(1000);
+        }
+        if (__atomic_load_n(&control->magic, __ATOMIC_ACQUIRE) != CONTROL_MAGIC)
+        {
+            LOG_ERROR("Shared memory control was not initialized by its creator (name=%s)", name);
+            munmap(control, sizeof(control_t));
+            control = NULL;
+        }
+
+        /* segment created by an older version keeps gain and mute */
+        else if (control->version < CONTROL_VERSION)
+        {
+            control->version = CONTROL_VERSION;
+        }
+    }
+
+    return control;
+}
+
+
+/* opening a destination device with the same HW parameters for primary and secondary destinations */
+static int open_device(plugin_data_t* plugin_data, const char* device, snd_pcm_t** pcm_handle, int mode)
+{
+    int                  error     = 0;
+    snd_pcm_hw_params_t* hw_params = NULL;
+
+    /* opening the target device */
+    if (!error)
+    {
+        if ((error = snd_pcm_open(pcm_handle, device, SND_PCM_STREAM_PLAYBACK, mode)) < 0)
+        {
+            LOG_ERROR("Could not open destination device %s: %s", device, snd_strerror(error));
+        }
+    }
+
+    /* allocating hardware parameters object and fill it with default values */
+    if (!error)
+    {
+        if ((error = snd_pcm_hw_params_malloc(&hw_params)) < 0)
+        {
+            LOG_ERROR("Could not allocate HW parameters: %s", snd_strerror(error));
+        }
+    }
+    if (!error)
+    {
+        if ((error = snd_pcm_hw_params_any(*pcm_handle, hw_params)) < 0)
+        {
+            LOG_ERROR("Could not fill HW parameters with defaults: %s", snd_strerror(error));
+        }
+    }
+
+    /* setting target device parameters */
+    if (!error)
+    {
+        if ((error = snd_pcm_hw_params_set_access(*pcm_handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
+        {
+            LOG_ERROR("Could not set destination device access mode: %s", snd_strerror(error));
+        }
+    }
+    if (!error)
+    {
+        if ((error = snd_pcm_hw_params_set_format(*pcm_handle, hw_params, plugin_data->dst_format)) < 0)
+        {
+            LOG_ERROR("Could not set destination device format: %s %d", snd_strerror(error), plugin_data->dst_format);
+        }
+    }
+    if (!error)
+    {
+        if ((error = snd_pcm_hw_params_set_channels(*pcm_handle, hw_params, plugin_data->dst_channels)) < 0)
+        {
+            LOG_ERROR("Could not set amount of channels for destination device: %s", snd_strerror(error));
+        }
+    }
+    if (!error)
+    {
+        if ((error = snd_pcm_hw_params_set_rate(*pcm_handle, hw_params, plugin_data->alsa_data.rate, 0)) < 0)
+        {
+            LOG_ERROR("Could not set sample rate for destination device: %s", snd_strerror(error));
+        }
+    }
+    if (!error)
+    {
+        if ((error = snd_pcm_hw_params_set_period_size(*pcm_handle, hw_params, plugin_data->dst_period_size, 0)) < 0)
+        {
+            LOG_ERROR("Could not set period size for destination device: %s", snd_strerror(error));
+        }
+    }
+    if (!error)
+    {
+        if ((error = snd_pcm_hw_params_set_periods(*pcm_handle, hw_params, plugin_data->dst_periods, 0)) < 0)
+        {
+            LOG_ERROR("Could not set amount of periods for destination device: %s", snd_strerror(error));
+        }
+    }
+
+#if SND_LIB_VERSION >= 0x010009
+    /* disabling ALSA resampling */
+    if (!error)
+    {
+        if ((error = snd_pcm_hw_params_set_rate_resample(*pcm_handle, hw_params, 0)) < 0)
+        {
+            LOG_ERROR("Could not disable ALSA resampling: %s", snd_strerror(error));
+        }
+    }
+#endif
+
+    /* saving hardware parameters for target device */
+    if (!error)
+    {
+        if ((error = snd_pcm_hw_params(*pcm_handle, hw_params)) < 0)
+        {
+            LOG_ERROR("Could set hardware parameters: %s", snd_strerror(error));
+        }
+    }
+    if (hw_params)
+    {
+        snd_pcm_hw_params_free(hw_params);
+    }
+
+    /* device is not left half-configured */
+    if (error && *pcm_handle)
+    {
+        snd_pcm_close(*pcm_handle);
+        *pcm_handle = NULL;
+    }
+
+    return error;
+}
+
+
+int open_destination_device(plugin_data_t* plugin_data)
+{
+    int error = 0;
+
+    /* taking over destination device still owned by a background drain instead of waiting for the drain to complete */
+    if (!reclaim_destination_device(plugin_data))
+    {
+        return error;
+    }
+
+    /* opening the target device */
+    if (!error)
+    {
+        error = open_device(plugin_data, plugin_data->dst_device, &plugin_data->dst_pcm_handle, 0);
     }
 
     /* allocating buffer required to transfer data to target device */
@@ -266,31 +1191,509 @@ int open_destination_device(plugin_data_t* plugin_data)
         /* it will allow multiple calls to set ALSA HW parameters */
         if (plugin_data->dst_buffer)
         {
-            free(plugin_data->dst_buffer);
+            free_buffer(plugin_data, plugin_data->dst_buffer, plugin_data->dst_buffer_bytes);
             plugin_data->dst_buffer = NULL;
         }
 
-        /* target buffer must not be equal to the source buffer size; otherwise pointer callback will always return 0 */
-        plugin_data->dst_buffer_size    = plugin_data->dst_period_size;
-        plugin_data->dst_buffer_current = 0;
+        /* target buffer must not be equal to the source buffer size; otherwise pointer callback will always return 0 */
+        plugin_data->dst_buffer_size    = plugin_data->dst_period_size;
+        plugin_data->dst_buffer_current = 0;
+
+        /* adding extra space for one extra channel */
+        size_t size_in_bytes = plugin_data->dst_buffer_size * (snd_pcm_format_physical_width(plugin_data->dst_format) >> 3) * plugin_data->dst_channels;
+
+        /* buffer is allocated zeroed, pre-faulted and optionally locked in memory */
+        plugin_data->dst_buffer       = allocate_buffer(plugin_data, size_in_bytes);
+        plugin_data->dst_buffer_bytes = size_in_bytes;
+        if (!plugin_data->dst_buffer)
+        {
+            error = -ENOMEM;
+            LOG_ERROR("Could not allocate memory for transfer buffer (requested %lu bytes)", size_in_bytes);
+        }
+        else
+        {
+            LOG_DEBUG("Transfer buffer was allocated (%ld bytes)", size_in_bytes);
+        }
+    }
+
+    /* allocating silence written after xrun recovery; it is prepared here so recovery does not allocate or convert anything */
+    if (!error)
+    {
+        if (plugin_data->xrun_buffer)
+        {
+            free_buffer(plugin_data, plugin_data->xrun_buffer, plugin_data->xrun_buffer_bytes);
+            plugin_data->xrun_buffer = NULL;
+        }
+
+        /* at least one marker frame is written so the consumer always knows about the gap */
+        size_t            target_frame_size = (snd_pcm_format_physical_width(plugin_data->dst_format) >> 3) * plugin_data->dst_channels;
+        snd_pcm_uframes_t frames            = (snd_pcm_uframes_t)plugin_data->alsa_data.rate * plugin_data->xrun_prefill / 1000;
+        snd_pcm_uframes_t max_frames        = plugin_data->dst_period_size * (plugin_data->dst_periods - 1);
+        plugin_data->xrun_buffer_size       = (frames < 1 ? 1 : (frames > max_frames ? max_frames : frames));
+        plugin_data->xrun_buffer_bytes      = plugin_data->xrun_buffer_size * target_frame_size;
+
+        plugin_data->xrun_buffer = allocate_buffer(plugin_data, plugin_data->xrun_buffer_bytes);
+        if (!plugin_data->xrun_buffer)
+        {
+            error = -ENOMEM;
+            LOG_ERROR("Could not allocate memory for xrun recovery buffer (requested %lu bytes)", plugin_data->xrun_buffer_bytes);
+        }
+        else
+        {
+            for (snd_pcm_uframes_t i = 0; i < plugin_data->xrun_buffer_size; i++)
+            {
+                plugin_data->xrun_buffer[(i + 1) * target_frame_size - 1] = XRUN_MARKER;
+            }
+        }
+    }
+
+    /* secondary destinations are optional, so failing to open them does not fail the stream */
+    if (!error)
+    {
+        open_secondary_destinations(plugin_data);
+    }
+
+    return error;
+}
+
+
+/* buffers, secondary destinations and dump files adopted from a drain must be the ones this instance would set up itself */
+static int is_same_setup(plugin_data_t* plugin_data, plugin_data_t* drain_data)
+{
+    if (plugin_data->lock_memory != drain_data->lock_memory || plugin_data->secondaries_size != drain_data->secondaries_size)
+    {
+        return 0;
+    }
+    if (!plugin_data->pcm_dump_file_name != !drain_data->pcm_dump_file_name ||
+        (plugin_data->pcm_dump_file_name && strcmp(plugin_data->pcm_dump_file_name, drain_data->pcm_dump_file_name) != 0))
+    {
+        return 0;
+    }
+    for (unsigned int i = 0; i < plugin_data->secondaries_size; i++)
+    {
+        if (strcmp(plugin_data->secondaries[i].device, drain_data->secondaries[i].device) != 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+static int is_same_device(plugin_data_t* plugin_data, plugin_data_t* drain_data)
+{
+    return strcmp(plugin_data->dst_device, drain_data->dst_device) == 0 &&
+           plugin_data->alsa_data.rate     == drain_data->alsa_data.rate &&
+           plugin_data->dst_format         == drain_data->dst_format &&
+           plugin_data->dst_channels       == drain_data->dst_channels &&
+           plugin_data->dst_period_size    == drain_data->dst_period_size &&
+           plugin_data->dst_periods        == drain_data->dst_periods &&
+           plugin_data->xrun_prefill       == drain_data->xrun_prefill &&
+           is_same_setup(plugin_data, drain_data);
+}
+
+
+static int is_same_stream(plugin_data_t* plugin_data, plugin_data_t* drain_data)
+{
+    return is_same_device(plugin_data, drain_data) &&
+           plugin_data->alsa_data.channels == drain_data->alsa_data.channels &&
+           plugin_data->src_format         == drain_data->src_format;
+}
+
+
+FILE* open_pcm_dump_info_file(const char* pcm_dump_file_name)
+{
+    FILE* info_file = NULL;
+    char* info_file_name;
+
+    /* info file is kept next to the dump file */
+    info_file_name = malloc(strlen(pcm_dump_file_name) + sizeof(PCM_DUMP_INFO_SUFFIX));
+    if (!info_file_name)
+    {
+        LOG_ERROR("Could not allocate memory for PCM dump info file name (requested %lu bytes)", strlen(pcm_dump_file_name) + sizeof(PCM_DUMP_INFO_SUFFIX));
+        return NULL;
+    }
+    strcpy(info_file_name, pcm_dump_file_name);
+    strcat(info_file_name, PCM_DUMP_INFO_SUFFIX);
+
+    info_file = fopen(info_file_name, "a");
+    if (!info_file)
+    {
+        LOG_ERROR("Could not open PCM dump info file (error=%s, file name=%s)", strerror(errno), info_file_name);
+    }
+    free(info_file_name);
+
+    return info_file;
+}
+
+
+void open_secondary_destinations(plugin_data_t* plugin_data)
+{
+    size_t target_frame_size = (snd_pcm_format_physical_width(plugin_data->dst_format) >> 3) * plugin_data->dst_channels;
+
+    for (unsigned int i = 0; i < plugin_data->secondaries_size; i++)
+    {
+        secondary_destination_t* secondary = &plugin_data->secondaries[i];
+
+        /* it will allow multiple calls to set ALSA HW parameters */
+        if (secondary->pcm_handle)
+        {
+            snd_pcm_close(secondary->pcm_handle);
+            secondary->pcm_handle = NULL;
+        }
+        if (secondary->backlog)
+        {
+            free_buffer(plugin_data, secondary->backlog, secondary->backlog_bytes);
+            secondary->backlog = NULL;
+        }
+        secondary->backlog_current = 0;
+        secondary->dropped_frames  = 0;
+
+        /* non-blocking mode makes sure writing to a slow destination never waits */
+        if (open_device(plugin_data, secondary->device, &secondary->pcm_handle, SND_PCM_NONBLOCK) < 0)
+        {
+            LOG_WARNING("Secondary destination device %s will not be used", secondary->device);
+            continue;
+        }
+
+        /* backlog can keep as much as the whole destination buffer */
+        secondary->backlog_size  = plugin_data->dst_period_size * plugin_data->dst_periods;
+        secondary->backlog_bytes = secondary->backlog_size * target_frame_size;
+        secondary->backlog       = allocate_buffer(plugin_data, secondary->backlog_bytes);
+        if (!secondary->backlog)
+        {
+            LOG_WARNING("Could not allocate memory for secondary destination backlog (requested %lu bytes)", secondary->backlog_bytes);
+            snd_pcm_close(secondary->pcm_handle);
+            secondary->pcm_handle = NULL;
+            continue;
+        }
+
+        LOG_INFO("Secondary destination device %s was opened", secondary->device);
+    }
+}
+
+
+int parse_cpu_list(const char* cpu_list, cpu_set_t* cpus)
+{
+    const char* str = cpu_list;
+    char*       end;
+
+    CPU_ZERO(cpus);
+
+    /* list is a comma separated set of CPU numbers and ranges, like "2,4-5" */
+    while (*str)
+    {
+        long first = strtol(str, &end, 10);
+        long last  = first;
+
+        if (end == str || first < 0 || first >= CPU_SETSIZE)
+        {
+            return -EINVAL;
+        }
+        if (*end == '-')
+        {
+            str  = end + 1;
+            last = strtol(str, &end, 10);
+            if (end == str || last < first || last >= CPU_SETSIZE)
+            {
+                return -EINVAL;
+            }
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            CPU_SET(cpu, cpus);
+        }
+
+        if (*end && *end != ',')
+        {
+            return -EINVAL;
+        }
+        str = (*end == ',' ? end + 1 : end);
+    }
+
+    return CPU_COUNT(cpus) ? 0 : -EINVAL;
+}
+
+
+/* square root rounded down; RMS values are below 2^16 so the loop is short */
+static uint32_t integer_sqrt(uint64_t value)
+{
+    uint64_t result = 0;
+    uint64_t bit    = (uint64_t)1 << 62;
+
+    while (bit > value)
+    {
+        bit >>= 2;
+    }
+    while (bit)
+    {
+        if (value >= result + bit)
+        {
+            value  -= result + bit;
+            result  = (result >> 1) + bit;
+        }
+        else
+        {
+            result >>= 1;
+        }
+        bit >>= 2;
+    }
+
+    return (uint32_t)result;
+}
+
+
+void publish_meters(plugin_data_t* plugin_data)
+{
+    unsigned int channels = (plugin_data->dst_channels - 1 < MAX_SOURCE_CHANNELS ? plugin_data->dst_channels - 1 : MAX_SOURCE_CHANNELS);
+    control_t*   control  = plugin_data->control;
+
+    for (unsigned int c = 0; c < channels; c++)
+    {
+        plugin_data->meter_last_peak[c] = plugin_data->meter_peak[c];
+        plugin_data->meter_last_rms[c]  = (plugin_data->meter_frames ? integer_sqrt(plugin_data->meter_sum[c] / plugin_data->meter_frames) : 0);
+        plugin_data->meter_peak[c]      = 0;
+        plugin_data->meter_sum[c]       = 0;
+    }
+    plugin_data->meter_frames = 0;
+
+    /* segment released by another instance is taken over silently */
+    uint64_t writer = 0;
+    if (control && __atomic_load_n(&control->meter_writer, __ATOMIC_RELAXED) != plugin_data->meter_writer_id &&
+        !__atomic_compare_exchange_n(&control->meter_writer, &writer, plugin_data->meter_writer_id, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    {
+        control = NULL;
+    }
+
+    /* sequence lock writer: readers retry if sequence was odd or has changed while they were copying (see control_read_meters) */
+    if (control)
+    {
+        __atomic_fetch_add(&control->meter_sequence, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        control->meter_channels = channels;
+        for (unsigned int c = 0; c < channels; c++)
+        {
+            control->meter_peak[c] = plugin_data->meter_last_peak[c];
+            control->meter_rms[c]  = plugin_data->meter_last_rms[c];
+        }
+        control->meter_windows++;
+
+        __atomic_fetch_add(&control->meter_sequence, 1, __ATOMIC_RELEASE);
+    }
+
+    PROBE_METERS(plugin_data->meter_last_peak[0], plugin_data->meter_last_rms[0]);
+}
+
+
+int reclaim_destination_device(plugin_data_t* plugin_data)
+{
+    int                 error = -ENOENT;
+    background_drain_t* drain;
+
+    pthread_mutex_lock(&background_drains_lock);
+
+    for (;;)
+    {
+        /* parked stream on the same device which can not be continued is finished straight away instead of at the end of grace period */
+        for (drain = background_drains; drain; drain = drain->next)
+        {
+            if (drain->parked && strcmp(plugin_data->dst_device, drain->plugin_data.dst_device) == 0 &&
+                !(plugin_data->gapless_window > 0 && is_same_stream(plugin_data, &drain->plugin_data)))
+            {
+                drain->parked = 0;
+                pthread_cond_broadcast(&background_drains_cond);
+            }
+        }
+
+        /* drain with another setup is left to finish, then the device is opened from scratch */
+        for (drain = background_drains; drain && !is_same_device(plugin_data, &drain->plugin_data); drain = drain->next);
+        if (!drain)
+        {
+            break;
+        }
+
+        /* device can be taken over only while the drainer is not writing to it */
+        if (!drain->busy && (drain->parked || drain->draining))
+        {
+            break;
+        }
+        pthread_cond_wait(&background_drains_cond, &background_drains_lock);
+    }
+
+    if (drain)
+    {
+        plugin_data->dst_pcm_handle     = drain->plugin_data.dst_pcm_handle;
+        plugin_data->dst_buffer         = drain->plugin_data.dst_buffer;
+        plugin_data->dst_buffer_bytes   = drain->plugin_data.dst_buffer_bytes;
+        plugin_data->dst_buffer_size    = drain->plugin_data.dst_buffer_size;
+        plugin_data->dst_buffer_current = 0;
+        plugin_data->xrun_buffer        = drain->plugin_data.xrun_buffer;
+        plugin_data->xrun_buffer_bytes  = drain->plugin_data.xrun_buffer_bytes;
+        plugin_data->xrun_buffer_size   = drain->plugin_data.xrun_buffer_size;
+        plugin_data->secondaries_size   = drain->plugin_data.secondaries_size;
+        for (unsigned int i = 0; i < drain->plugin_data.secondaries_size; i++)
+        {
+            plugin_data->secondaries[i] = drain->plugin_data.secondaries[i];
+        }
+        plugin_data->pcm_dump_file      = drain->plugin_data.pcm_dump_file;
+        plugin_data->pcm_dump_info_file = drain->plugin_data.pcm_dump_info_file;
+
+        if (drain->parked)
+        {
+            /* stream is continued without end and beginning of stream markers */
+            plugin_data->transfer_started = 1;
+            plugin_data->stream_continued = 1;
+            LOG_INFO("Destination stream was continued without reopening");
+        }
+        else
+        {
+            /* previous stream was ended, so the next transfer begins a new one while the loopback is still playing out the old one */
+            if (snd_pcm_state(plugin_data->dst_pcm_handle) == SND_PCM_STATE_XRUN)
+            {
+                snd_pcm_prepare(plugin_data->dst_pcm_handle);
+            }
+            plugin_data->transfer_started = 0;
+            plugin_data->stream_continued = 0;
+            LOG_INFO("Destination device was taken over from background drain without reopening");
+        }
+
+        drain->reclaimed = 1;
+        remove_background_drain(drain);
+        pthread_cond_broadcast(&background_drains_cond);
+
+        error = 0;
+    }
+
+    pthread_mutex_unlock(&background_drains_lock);
+
+    return error;
+}
+
+
+int recover_destination_device(plugin_data_t* plugin_data, int error)
+{
+    unsigned long long started_at  = get_time_us();
+    int                write_error = error;
+    snd_pcm_sframes_t  result;
+
+    /* restarting the stream after xrun or suspend; other errors are not recoverable */
+    if ((error = snd_pcm_recover(plugin_data->dst_pcm_handle, error, 1)) < 0)
+    {
+        LOG_ERROR("Target device restore error: %s", snd_strerror(error));
+    }
+
+    /* pre-filling marked silence so playback restarts straight away instead of waiting for the start threshold to be reached with pending data */
+    if (!error && plugin_data->xrun_buffer)
+    {
+        if (plugin_data->pcm_dump_file && plugin_data->pcm_dump_info_file)
+        {
+            fprintf(plugin_data->pcm_dump_info_file, "marker offset=%ld value=%u\n", ftell(plugin_data->pcm_dump_file), XRUN_MARKER);
+        }
+
+        result = snd_pcm_writei(plugin_data->dst_pcm_handle, plugin_data->xrun_buffer, plugin_data->xrun_buffer_size);
+        if (result > 0)
+        {
+            /* secondary destinations get the same gap, so their consumers see where the primary stream was interrupted */
+            write_to_pcm_dump_file(plugin_data, plugin_data->xrun_buffer, result);
+            write_to_secondary_destinations(plugin_data, plugin_data->xrun_buffer, result);
+        }
+        else if (result < 0 && result != -EAGAIN)
+        {
+            error = result;
+            LOG_ERROR("Could not write silence to target device after xrun: %s", snd_strerror(error));
+        }
+    }
+
+    /* keeping recovery statistics */
+    unsigned long long recovery_time = get_time_us() - started_at;
+    plugin_data->xrun_count++;
+    plugin_data->xrun_recovery_time += recovery_time;
+    if (plugin_data->xrun_recovery_time_max < recovery_time)
+    {
+        plugin_data->xrun_recovery_time_max = recovery_time;
+    }
+    PROBE_XRUN_RECOVERY(write_error, error, recovery_time);
+
+    LOG_WARNING("Target device xrun was recovered (result=%s, recovery time=%llu us, xruns=%lu)", snd_strerror(error), recovery_time, plugin_data->xrun_count);
+
+    return error;
+}
+
+
+void release_meters(plugin_data_t* plugin_data)
+{
+    uint64_t writer = plugin_data->meter_writer_id;
+
+    if (plugin_data->control)
+    {
+        __atomic_compare_exchange_n(&plugin_data->control->meter_writer, &writer, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+}
+
+
+/* kernel thread id is used, so settings can be restored from any thread and a thread which is gone is simply skipped */
+void restore_realtime_scheduling(plugin_data_t* plugin_data)
+{
+    if (!plugin_data->rt_thread_set)
+    {
+        return;
+    }
+    plugin_data->rt_thread_set = 0;
+
+    if (plugin_data->rt_cpus_set && sched_setaffinity(plugin_data->rt_thread, sizeof(cpu_set_t), &plugin_data->rt_saved_cpus) < 0 && errno != ESRCH)
+    {
+        LOG_WARNING("Could not restore CPU affinity of delivery thread (error=%s)", strerror(errno));
+    }
+    if (plugin_data->rt_priority && sched_setscheduler(plugin_data->rt_thread, plugin_data->rt_saved_policy, &plugin_data->rt_saved_param) < 0 && errno != ESRCH)
+    {
+        LOG_WARNING("Could not restore scheduling policy of delivery thread (error=%s)", strerror(errno));
+    }
+    else
+    {
+        LOG_DEBUG("Scheduling settings of delivery thread were restored");
+    }
+}
+
 
-        /* adding extra space for one extra channel */
-        size_t size_in_bytes = plugin_data->dst_buffer_size * (snd_pcm_format_physical_width(plugin_data->dst_format) >> 3) * (plugin_data->alsa_data.channels + 1);
+int set_channel_matrix(plugin_data_t* plugin_data, unsigned int channels, const char* coefficients)
+{
+    channel_matrix_t* matrix = NULL;
+    const char*       str    = coefficients;
+    char*             end;
+    channel_matrix_t  parsed = {channels, {{0}}};
 
-        /* calloc sets content to zero */
-        plugin_data->dst_buffer = (unsigned char*) calloc(1, size_in_bytes);
-        if (!plugin_data->dst_buffer)
+    for (unsigned int i = 0; i < ARRAY_SIZE(plugin_data->channel_matrices) && !matrix; i++)
+    {
+        if (plugin_data->channel_matrices[i].channels == channels)
         {
-            error = -ENOMEM;
-            LOG_ERROR("Could not allocate memory for transfer buffer (requested %lu bytes)", size_in_bytes);
+            matrix = &plugin_data->channel_matrices[i];
         }
-        else
+    }
+    if (!matrix)
+    {
+        return -EINVAL;
+    }
+
+    /* coefficients are provided row by row: left output row first, then right output row */
+    for (unsigned int o = 0; o < OUTPUT_CHANNELS; o++)
+    {
+        for (unsigned int c = 0; c < channels; c++)
         {
-            LOG_DEBUG("Transfer buffer was allocated (%ld bytes)", size_in_bytes);
+            double coefficient = strtod(str, &end);
+            if (end == str)
+            {
+                return -EINVAL;
+            }
+            parsed.coefficients[o][c] = (int)(coefficient * MATRIX_UNITY + (coefficient < 0 ? -0.5 : 0.5));
+            str = end;
         }
     }
 
-    return error;
+    *matrix = parsed;
+
+    return 0;
 }
 
 
@@ -305,6 +1708,15 @@ int set_dst_hw_params(plugin_data_t* plugin_data, snd_pcm_hw_params_t *params)
         if (plugin_data->rate_device_map[i].rate == plugin_data->alsa_data.rate)
         {
             plugin_data->dst_device = plugin_data->rate_device_map[i].device;
+
+            /* the same stream is delivered to secondary devices as well */
+            close_secondary_destinations(plugin_data);
+            plugin_data->secondaries_size = plugin_data->rate_device_map[i].secondary_devices_size;
+            for (unsigned int j = 0; j < plugin_data->secondaries_size; j++)
+            {
+                memset(&plugin_data->secondaries[j], 0, sizeof(secondary_destination_t));
+                plugin_data->secondaries[j].device = plugin_data->rate_device_map[i].secondary_devices[j];
+            }
         }
     }
     if (!plugin_data->dst_device)
@@ -352,6 +1764,53 @@ int set_dst_hw_params(plugin_data_t* plugin_data, snd_pcm_hw_params_t *params)
         }
     }
 
+    /* 8 and 16 bits sources can be delivered as S16 to use less loopback bandwidth; metadata channel has the same format */
+    if (!error)
+    {
+        if (plugin_data->native_width && (plugin_data->src_format == SND_PCM_FORMAT_S8 || plugin_data->src_format == SND_PCM_FORMAT_S16_LE))
+        {
+            plugin_data->dst_format = NATIVE_WIDTH_FORMAT;
+        }
+        else
+        {
+            plugin_data->dst_format = TARGET_FORMAT;
+        }
+
+        LOG_INFO("destination format=%s", snd_pcm_format_name(plugin_data->dst_format));
+    }
+
+    /* choosing channel matrix if downmixing is required; metadata channel is added on top */
+    if (!error)
+    {
+        plugin_data->channel_matrix = NULL;
+        for (unsigned int i = 0; plugin_data->downmix && i < ARRAY_SIZE(plugin_data->channel_matrices); i++)
+        {
+            if (plugin_data->channel_matrices[i].channels == plugin_data->alsa_data.channels)
+            {
+                plugin_data->channel_matrix = &plugin_data->channel_matrices[i];
+            }
+        }
+        plugin_data->dst_channels = (plugin_data->channel_matrix ? OUTPUT_CHANNELS : plugin_data->alsa_data.channels) + 1;
+
+        LOG_INFO("source channels=%u, destination channels=%u", plugin_data->alsa_data.channels, plugin_data->dst_channels);
+    }
+
+    /* metering windows are restarted with every stream */
+    if (!error && plugin_data->metering)
+    {
+        plugin_data->meter_window  = (plugin_data->alsa_data.rate * METER_WINDOW_MS) / 1000;
+        plugin_data->meter_window  = (plugin_data->meter_window ? plugin_data->meter_window : 1);
+        plugin_data->meter_frames  = 0;
+        plugin_data->meter_channel = 0;
+        memset(plugin_data->meter_peak, 0, sizeof(plugin_data->meter_peak));
+        memset(plugin_data->meter_sum, 0, sizeof(plugin_data->meter_sum));
+        memset(plugin_data->meter_last_peak, 0, sizeof(plugin_data->meter_last_peak));
+        memset(plugin_data->meter_last_rms, 0, sizeof(plugin_data->meter_last_rms));
+
+        /* levels are still measured for metadata and probes if another instance publishes them */
+        claim_meters(plugin_data);
+    }
+
     if (!error)
     {
         error = open_destination_device(plugin_data);
@@ -361,7 +1820,7 @@ int set_dst_hw_params(plugin_data_t* plugin_data, snd_pcm_hw_params_t *params)
 }
 
 
-int set_dst_sw_params(plugin_data_t* plugin_data, snd_pcm_sw_params_t *params)
+static int set_device_sw_params(plugin_data_t* plugin_data, snd_pcm_t* pcm_handle)
 {
     int                  error     = 0;
     snd_pcm_sw_params_t* sw_params = NULL;
@@ -376,21 +1835,21 @@ int set_dst_sw_params(plugin_data_t* plugin_data, snd_pcm_sw_params_t *params)
     }
     if (!error)
     {
-        if ((error = snd_pcm_sw_params_current(plugin_data->dst_pcm_handle, sw_params)) < 0)
+        if ((error = snd_pcm_sw_params_current(pcm_handle, sw_params)) < 0)
         {
             LOG_ERROR("Could not fill SW parameters with defaults: %s", snd_strerror(error));
         }
     }
     if (!error)
     {
-        if ((error = snd_pcm_sw_params_set_start_threshold(plugin_data->dst_pcm_handle, sw_params, plugin_data->dst_buffer_size)) < 0)
+        if ((error = snd_pcm_sw_params_set_start_threshold(pcm_handle, sw_params, plugin_data->dst_buffer_size)) < 0)
         {
             LOG_ERROR("Could not set threshold for destination device: %s", snd_strerror(error));
         }
     }
     if (!error)
     {
-        if ((error = snd_pcm_sw_params_set_avail_min(plugin_data->dst_pcm_handle, sw_params, plugin_data->dst_period_size)) < 0)
+        if ((error = snd_pcm_sw_params_set_avail_min(pcm_handle, sw_params, plugin_data->dst_period_size)) < 0)
         {
             LOG_ERROR("Could not set min available amount for destination device: %s", snd_strerror(error));
         }
@@ -399,7 +1858,7 @@ int set_dst_sw_params(plugin_data_t* plugin_data, snd_pcm_sw_params_t *params)
     /* saving software parameters for target device */
     if (!error)
     {
-        if ((error = snd_pcm_sw_params(plugin_data->dst_pcm_handle, sw_params)) < 0)
+        if ((error = snd_pcm_sw_params(pcm_handle, sw_params)) < 0)
         {
             LOG_ERROR("Could set software parameters: %s", snd_strerror(error));
         }
@@ -413,6 +1872,31 @@ int set_dst_sw_params(plugin_data_t* plugin_data, snd_pcm_sw_params_t *params)
 }
 
 
+int set_dst_sw_params(plugin_data_t* plugin_data, snd_pcm_sw_params_t *params)
+{
+    int error = set_device_sw_params(plugin_data, plugin_data->dst_pcm_handle);
+
+    /* secondary destinations use the same thresholds */
+    for (unsigned int i = 0; !error && i < plugin_data->secondaries_size; i++)
+    {
+        if (plugin_data->secondaries[i].pcm_handle && set_device_sw_params(plugin_data, plugin_data->secondaries[i].pcm_handle) < 0)
+        {
+            LOG_WARNING("Could not set SW parameters for secondary destination device %s", plugin_data->secondaries[i].device);
+        }
+    }
+
+    return error;
+}
+
+
+/* logging settings are per plugin instance, so they are applied to the calling thread before it works for the instance */
+void set_logging(plugin_data_t* plugin_data)
+{
+    log_level = plugin_data->log_level;
+    log_file  = plugin_data->log_file;
+}
+
+
 int set_src_hw_params(snd_pcm_ioplug_t *io)
 {
     int error = 0;
@@ -435,10 +1919,19 @@ int set_src_hw_params(snd_pcm_ioplug_t *io)
         }
     }
 
-    /* supported amount of channels */
+    /* supported amount of channels; more layouts are accepted if they are downmixed */
     if (!error)
     {
-        if ((error = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_CHANNELS, ARRAY_SIZE(supported_channels), supported_channels)) < 0)
+        plugin_data_t* plugin_data = (plugin_data_t*)io->private_data;
+        if (plugin_data->downmix)
+        {
+            error = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_CHANNELS, ARRAY_SIZE(supported_downmix_channels), supported_downmix_channels);
+        }
+        else
+        {
+            error = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_CHANNELS, ARRAY_SIZE(supported_channels), supported_channels);
+        }
+        if (error < 0)
         {
             LOG_ERROR("Could not set required amount of channels: %s", snd_strerror(error));
         }
@@ -473,6 +1966,229 @@ int set_src_hw_params(snd_pcm_ioplug_t *io)
 }
 
 
+/* kernel thread id is cached, so checking whether settings were applied does not cost a syscall per transfer */
+static pid_t get_thread_id()
+{
+    static __thread pid_t thread_id = 0;
+
+    if (!thread_id)
+    {
+        thread_id = (pid_t)syscall(SYS_gettid);
+    }
+
+    return thread_id;
+}
+
+
+void set_realtime_scheduling(plugin_data_t* plugin_data)
+{
+    /* real-time settings are opt-in */
+    if (!plugin_data->rt_priority && !plugin_data->rt_cpus_set)
+    {
+        return;
+    }
+
+    /* settings are applied once per thread doing the delivery */
+    pid_t thread = get_thread_id();
+    if (plugin_data->rt_thread_set && plugin_data->rt_thread == thread)
+    {
+        return;
+    }
+
+    /* application switched to another thread, so the previous one gets its own settings back */
+    restore_realtime_scheduling(plugin_data);
+
+    /* saving current settings, so the application thread is left as it was found when the plugin is closed */
+    plugin_data->rt_saved_policy = sched_getscheduler(0);
+    if (plugin_data->rt_saved_policy < 0 || sched_getparam(0, &plugin_data->rt_saved_param) < 0 ||
+        sched_getaffinity(0, sizeof(cpu_set_t), &plugin_data->rt_saved_cpus) < 0)
+    {
+        LOG_WARNING("Real-time settings are not applied as current settings of delivery thread could not be saved (error=%s)", strerror(errno));
+        return;
+    }
+    plugin_data->rt_thread     = thread;
+    plugin_data->rt_thread_set = 1;
+
+    if (plugin_data->rt_cpus_set && sched_setaffinity(0, sizeof(cpu_set_t), &plugin_data->rt_cpus) < 0)
+    {
+        LOG_WARNING("Could not set CPU affinity for delivery thread (error=%s)", strerror(errno));
+    }
+
+    /* the same per-thread API is used to set and to restore the policy (see restore_realtime_scheduling) */
+    if (plugin_data->rt_priority)
+    {
+        struct sched_param param = {.sched_priority = plugin_data->rt_priority};
+        if (sched_setscheduler(0, SCHED_FIFO, &param) < 0)
+        {
+            LOG_WARNING("Could not set real-time priority for delivery thread (error=%s)", strerror(errno));
+        }
+        else
+        {
+            LOG_INFO("Delivery thread runs with SCHED_FIFO priority %u", plugin_data->rt_priority);
+        }
+    }
+}
+
+
+/* shared by transfer callback and replay tool, so both deliver data the same way */
+snd_pcm_uframes_t transfer_frames(plugin_data_t* plugin_data, const snd_pcm_channel_area_t* areas, snd_pcm_uframes_t offset, snd_pcm_uframes_t frames_provided, int consume_all, converted_callback_t converted_callback, void* context)
+{
+    size_t target_frame_size = (snd_pcm_format_physical_width(plugin_data->dst_format) >> 3) * plugin_data->dst_channels;
+
+    /* if this is the first time transfer is called then marking the biginning of PCM stream */
+    if (!plugin_data->transfer_started)
+    {
+        write_stream_marker(plugin_data, BEGINNING_OF_STREAM_MARKER);
+        plugin_data->transfer_started = 1;
+    }
+
+    /* if the stream was continued from the previous plugin instance then optionally marking the track boundary */
+    if (plugin_data->stream_continued)
+    {
+        if (plugin_data->track_boundary_marker)
+        {
+            write_stream_marker(plugin_data, TRACK_BOUNDARY_MARKER);
+        }
+        plugin_data->stream_continued = 0;
+    }
+
+    /* unless all frames must be consumed, transfer buffer is filled once; otherwise it is written and refilled until there is no progress */
+    snd_pcm_uframes_t frames_processed = 0;
+    snd_pcm_uframes_t frames_processable;
+    do
+    {
+        /* adjusting amount of frames to be processed, which is max(available,provided) */
+        snd_pcm_uframes_t frames_left    = frames_provided - frames_processed;
+        snd_pcm_uframes_t available_size = plugin_data->dst_buffer_size - plugin_data->dst_buffer_current;
+        frames_processable = frames_left;
+        if (available_size < frames_left)
+        {
+            LOG_DEBUG("More frames provided than buffer available (frames provided=%lu, available buffer size=%ld)", frames_left, available_size);
+            frames_processable = available_size;
+        }
+
+        /* latency deadline is counted from the moment the oldest pending frame was buffered */
+        if (!plugin_data->dst_buffer_current)
+        {
+            plugin_data->coalesce_started_at = get_time_us();
+        }
+        update_coalesce_watermark(plugin_data, frames_left);
+
+        /* copying frames from the source buffer to the target buffer */
+        unsigned char* target = plugin_data->dst_buffer + plugin_data->dst_buffer_current * target_frame_size;
+        PROBE_CONVERT_START(frames_processable, plugin_data->dst_buffer_current);
+        copy_frames(plugin_data, areas, offset + frames_processed, frames_processable);
+        PROBE_CONVERT_DONE(frames_processable, plugin_data->dst_buffer_current);
+        frames_processed += frames_processable;
+
+        /* letting the caller inspect converted frames before they are written */
+        if (converted_callback && frames_processable)
+        {
+            converted_callback(context, target, frames_processable * target_frame_size);
+        }
+
+        /* writting to the target device unless frames are coalesced into a bigger write */
+        if (is_write_due(plugin_data))
+        {
+            snd_pcm_sframes_t result = write_to_dst(plugin_data);
+            if (result < 0)
+            {
+                LOG_ERROR("Error while writting to target device: %s", snd_strerror(result));
+                plugin_data->write_errors++;
+            }
+            else if (result < frames_processable)
+            {
+                LOG_WARNING("Less frames were written to the target device than expected (written frames=%ld, expected to write frames=%ld)", result, frames_processable);
+            }
+        }
+    }
+    while (consume_all && frames_processable > 0 && frames_processed < frames_provided);
+
+    return frames_processed;
+}
+
+
+void update_coalesce_watermark(plugin_data_t* plugin_data, snd_pcm_uframes_t frames_provided)
+{
+    if (!plugin_data->coalesce_latency || !frames_provided)
+    {
+        return;
+    }
+
+    /* tracking moving average of client chunk sizes (new chunk has 1/8 weight) */
+    if (!plugin_data->coalesce_chunk_average)
+    {
+        plugin_data->coalesce_chunk_average = frames_provided;
+    }
+    else
+    {
+        plugin_data->coalesce_chunk_average = (plugin_data->coalesce_chunk_average * 7 + frames_provided) >> 3;
+    }
+
+    /* watermark is the largest multiple of the average chunk which fits into latency budget, so writes line up with client chunks */
+    snd_pcm_uframes_t chunk          = plugin_data->coalesce_chunk_average ? plugin_data->coalesce_chunk_average : 1;
+    snd_pcm_uframes_t latency_frames = (snd_pcm_uframes_t)plugin_data->alsa_data.rate * plugin_data->coalesce_latency / 1000;
+    snd_pcm_uframes_t watermark      = (latency_frames / chunk) * chunk;
+
+    if (watermark < chunk)
+    {
+        watermark = chunk;
+    }
+    if (watermark > plugin_data->dst_buffer_size)
+    {
+        watermark = plugin_data->dst_buffer_size;
+    }
+
+    if (watermark != plugin_data->coalesce_watermark)
+    {
+        LOG_DEBUG("Write coalescing watermark was changed (average chunk=%lu frames, watermark=%lu frames)", chunk, watermark);
+        plugin_data->coalesce_watermark = watermark;
+    }
+}
+
+
+void update_gain(plugin_data_t* plugin_data)
+{
+    if (!plugin_data->control)
+    {
+        return;
+    }
+
+    /* picking up volume set by a controlling application */
+    int target = (plugin_data->control->mute ? 0 : (int)plugin_data->control->gain);
+    if (target > CONTROL_GAIN_MAX)
+    {
+        target = CONTROL_GAIN_MAX;
+    }
+
+    /* ramp step is chosen so the whole change takes GAIN_RAMP_MS */
+    if (target != plugin_data->gain_target)
+    {
+        int ramp_frames = plugin_data->alsa_data.rate * GAIN_RAMP_MS / 1000;
+
+        plugin_data->gain_target = target;
+        plugin_data->gain_step   = abs(target - plugin_data->gain_current) / (ramp_frames > 0 ? ramp_frames : 1);
+        if (plugin_data->gain_step < 1)
+        {
+            plugin_data->gain_step = 1;
+        }
+
+        LOG_DEBUG("Gain was changed (gain=%d, step=%d)", target, plugin_data->gain_step);
+    }
+}
+
+
+void wait_for_background_drains()
+{
+    pthread_mutex_lock(&background_drains_lock);
+    while (background_drains_running > 0)
+    {
+        pthread_cond_wait(&background_drains_cond, &background_drains_lock);
+    }
+    pthread_mutex_unlock(&background_drains_lock);
+}
+
+
 void write_stream_marker(plugin_data_t* plugin_data, unsigned char marker)
 {
     snd_pcm_sframes_t result = 0;
@@ -488,28 +2204,85 @@ void write_stream_marker(plugin_data_t* plugin_data, unsigned char marker)
     }
 
     /* opening a dump file if configured and streaming starts */
-    if (pcm_dump_file_name && marker == BEGINNING_OF_STREAM_MARKER)
+    if (plugin_data->pcm_dump_file_name && marker == BEGINNING_OF_STREAM_MARKER)
     {
-        pcm_dump_file = fopen(pcm_dump_file_name, "a");
-        if (!pcm_dump_file)
+        plugin_data->pcm_dump_file = fopen(plugin_data->pcm_dump_file_name, "a");
+        if (!plugin_data->pcm_dump_file)
         {
             LOG_ERROR("Could not open PCM dump file, PCM data will not be save in the file (error=%s)", strerror(errno));
         }
+        else
+        {
+            /* making sure offsets written to the info file are counted from the beginning of the dump file */
+            fseek(plugin_data->pcm_dump_file, 0, SEEK_END);
+            plugin_data->pcm_dump_info_file = open_pcm_dump_info_file(plugin_data->pcm_dump_file_name);
+        }
+
+        /* info file describes the stream so the dump can be replayed */
+        if (plugin_data->pcm_dump_info_file)
+        {
+            fprintf(plugin_data->pcm_dump_info_file, "begin offset=%ld format=%s rate=%u channels=%u dst_format=%s dst_channels=%u\n",
+                ftell(plugin_data->pcm_dump_file),
+                snd_pcm_format_name(plugin_data->src_format),
+                plugin_data->alsa_data.rate,
+                plugin_data->alsa_data.channels,
+                snd_pcm_format_name(plugin_data->dst_format),
+                plugin_data->dst_channels);
+        }
+    }
+
+    /* xrun statistics are kept per stream */
+    if (marker == BEGINNING_OF_STREAM_MARKER)
+    {
+        plugin_data->xrun_count             = 0;
+        plugin_data->xrun_recovery_time     = 0;
+        plugin_data->xrun_recovery_time_max = 0;
+    }
+    else if (marker == END_OF_STREAM_MARKER && plugin_data->xrun_count)
+    {
+        LOG_INFO("Destination device xruns=%lu, recovery time total=%llu us, max=%llu us", plugin_data->xrun_count, plugin_data->xrun_recovery_time, plugin_data->xrun_recovery_time_max);
+    }
+
+    PROBE_MARKER(marker, plugin_data->pointer);
+
+    /* keeping marker timeline in the info file */
+    if (plugin_data->pcm_dump_file && plugin_data->pcm_dump_info_file)
+    {
+        fprintf(plugin_data->pcm_dump_info_file, "marker offset=%ld value=%u\n", ftell(plugin_data->pcm_dump_file), marker);
     }
 
     /* reseting target buffer */
     size_t target_sample_size = (snd_pcm_format_physical_width(plugin_data->dst_format) >> 3);
-    size_t target_frame_size  = target_sample_size * (plugin_data->alsa_data.channels + 1);
+    size_t target_frame_size  = target_sample_size * plugin_data->dst_channels;
     memset(plugin_data->dst_buffer, 0, plugin_data->dst_buffer_size * target_frame_size);
 
+    /* track boundary is a lightweight marker so it takes a single frame instead of the whole period */
+    snd_pcm_uframes_t marker_frames = (marker == TRACK_BOUNDARY_MARKER ? 1 : plugin_data->dst_buffer_size);
+
     /* marking stream as closed; useful to detect ALSA junk at the end */
-    for (snd_pcm_uframes_t i = 0; i < plugin_data->dst_buffer_size; i++)
+    for (snd_pcm_uframes_t i = 0; i < marker_frames; i++)
     {
         plugin_data->dst_buffer[(i + 1) * target_frame_size - 1] = marker;
     }
 
+    /* beginning of stream period describes the original stream, so the consumer can choose encoding straight away */
+    if (marker == BEGINNING_OF_STREAM_MARKER && marker_frames < DESCRIPTOR_SIZE)
+    {
+        LOG_WARNING("Stream descriptor is not written as period is too short (period size=%lu, required frames=%u)", marker_frames, DESCRIPTOR_SIZE);
+    }
+    else if (marker == BEGINNING_OF_STREAM_MARKER)
+    {
+        unsigned char descriptor[DESCRIPTOR_SIZE];
+
+        encode_stream_descriptor(plugin_data, descriptor);
+        for (unsigned int i = 0; i < DESCRIPTOR_SIZE; i++)
+        {
+            plugin_data->dst_buffer[(i + 1) * target_frame_size - target_sample_size] = descriptor[i];
+        }
+    }
+
     /* making sure a single period is written */
-    for (plugin_data->dst_buffer_current = plugin_data->dst_buffer_size; plugin_data->dst_buffer_current > 0 && result >= 0;)
+    for (__atomic_store_n(&plugin_data->dst_buffer_current, marker_frames, __ATOMIC_RELAXED); plugin_data->dst_buffer_current > 0 && result >= 0;)
     {
         result = write_to_dst(plugin_data);
         if (result < 0)
@@ -519,9 +2292,15 @@ void write_stream_marker(plugin_data_t* plugin_data, unsigned char marker)
     }
 
     /* closing a dump file if it is opened */
-    if (pcm_dump_file && marker == END_OF_STREAM_MARKER)
+    if (plugin_data->pcm_dump_file && marker == END_OF_STREAM_MARKER)
+    {
+        fclose(plugin_data->pcm_dump_file);
+        plugin_data->pcm_dump_file = NULL;
+    }
+    if (plugin_data->pcm_dump_info_file && marker == END_OF_STREAM_MARKER)
     {
-        fclose(pcm_dump_file);
+        fclose(plugin_data->pcm_dump_info_file);
+        plugin_data->pcm_dump_info_file = NULL;
     }
 }
 
@@ -533,52 +2312,130 @@ snd_pcm_sframes_t write_to_dst(plugin_data_t* plugin_data)
     /* if there is anything to be written to the target device */
     if (plugin_data->dst_buffer_current > 0)
     {
-        /* writing to the target device */
-        result = snd_pcm_writei(plugin_data->dst_pcm_handle, plugin_data->dst_buffer, plugin_data->dst_buffer_current);
-
-        /* no need to restore from an error in case of -EAGAIN */
-        if (result < 0 && result != -EAGAIN)
+        /* writing to the target device; pending frames are retried after recovery a limited amount of times */
+        for (unsigned int attempt = 0;; attempt++)
         {
-            result = snd_pcm_prepare(plugin_data->dst_pcm_handle);
-            if (result < 0)
+            PROBE_WRITE_START(plugin_data->dst_buffer_current, plugin_data->pointer);
+            result = snd_pcm_writei(plugin_data->dst_pcm_handle, plugin_data->dst_buffer, plugin_data->dst_buffer_current);
+            PROBE_WRITE_DONE(result, plugin_data->pointer);
+
+            /* no need to restore from an error in case of -EAGAIN */
+            if (result >= 0 || result == -EAGAIN || attempt >= XRUN_RECOVERY_ATTEMPTS)
             {
-                LOG_ERROR("Target device restore error: %s", snd_strerror(result));
+                break;
+            }
+            if ((result = recover_destination_device(plugin_data, result)) < 0)
+            {
+                break;
             }
         }
-        else if (result == -EAGAIN)
+
+        if (result == -EAGAIN)
         {
             /* it will make ALSA call transfer callback again with the same data */
+            PROBE_WRITE_AGAIN(plugin_data->dst_buffer_current);
             result = 0;
         }
         else if (result > 0)
         {
             /* dumping PCM content if configured */
-            if (pcm_dump_file)
-            {
-                size_t size_in_bytes = (plugin_data->dst_buffer_current * 3) << 2;
-                size_t bytes_written = fwrite(plugin_data->dst_buffer, 1, size_in_bytes, pcm_dump_file);
-                if (bytes_written != size_in_bytes)
-                {
-                    LOG_ERROR("Error while writting PCM data to file (error=%s)", strerror(ferror(pcm_dump_file)));
-                }
-            }
+            write_to_pcm_dump_file(plugin_data, plugin_data->dst_buffer, result);
+
+            /* secondary destinations get exactly the same frames as the primary one */
+            write_to_secondary_destinations(plugin_data, plugin_data->dst_buffer, result);
 
             /* if not all data was written then moving reminder of the target buffer to the beginning */
             if (result < plugin_data->dst_buffer_current)
             {
                 size_t            target_sample_size = (snd_pcm_format_physical_width(plugin_data->dst_format) >> 3);
-                size_t            target_frame_size  = target_sample_size * (plugin_data->alsa_data.channels + 1);
+                size_t            target_frame_size  = target_sample_size * plugin_data->dst_channels;
                 size_t            offset             = result * target_frame_size;
                 snd_pcm_uframes_t frames             = plugin_data->dst_buffer_current - result;
 
+                PROBE_WRITE_PARTIAL(result, plugin_data->dst_buffer_current);
                 memcpy(plugin_data->dst_buffer, plugin_data->dst_buffer + offset, frames * target_frame_size);
             }
 
-            /* updating target and ALSA buffers' pointers */
-            plugin_data->dst_buffer_current -= result;
-            plugin_data->pointer            += result;
+            /* updating target and ALSA buffers' pointers; ALSA pointer is wrapped here, so it never overflows */
+            /* delay and pointer callbacks read these while the write happens without holding the instance lock */
+            snd_pcm_sframes_t pointer = plugin_data->pointer + result;
+            if (plugin_data->alsa_data.buffer_size)
+            {
+                pointer %= plugin_data->alsa_data.buffer_size;
+            }
+            __atomic_store_n(&plugin_data->dst_buffer_current, plugin_data->dst_buffer_current - result, __ATOMIC_RELAXED);
+            __atomic_store_n(&plugin_data->pointer, pointer, __ATOMIC_RELAXED);
         }
     }
 
     return result;
 }
+
+
+void write_to_pcm_dump_file(plugin_data_t* plugin_data, unsigned char* buffer, snd_pcm_uframes_t frames)
+{
+    if (!plugin_data->pcm_dump_file)
+    {
+        return;
+    }
+
+    /* dump contains exactly the frames accepted by the target device */
+    size_t size_in_bytes = frames * (snd_pcm_format_physical_width(plugin_data->dst_format) >> 3) * plugin_data->dst_channels;
+    size_t bytes_written = fwrite(buffer, 1, size_in_bytes, plugin_data->pcm_dump_file);
+    if (bytes_written != size_in_bytes)
+    {
+        LOG_ERROR("Error while writting PCM data to file (error=%s)", strerror(ferror(plugin_data->pcm_dump_file)));
+    }
+}
+
+
+void write_to_secondary_destinations(plugin_data_t* plugin_data, unsigned char* buffer, snd_pcm_uframes_t frames)
+{
+    size_t target_frame_size = (snd_pcm_format_physical_width(plugin_data->dst_format) >> 3) * plugin_data->dst_channels;
+
+    for (unsigned int i = 0; i < plugin_data->secondaries_size; i++)
+    {
+        secondary_destination_t* secondary = &plugin_data->secondaries[i];
+        snd_pcm_sframes_t        result;
+
+        if (!secondary->pcm_handle)
+        {
+            continue;
+        }
+
+        /* appending frames to the backlog; frames which do not fit are dropped so a slow destination never stalls the primary one */
+        snd_pcm_uframes_t available = secondary->backlog_size - secondary->backlog_current;
+        snd_pcm_uframes_t accepted  = (frames < available ? frames : available);
+        memcpy(secondary->backlog + secondary->backlog_current * target_frame_size, buffer, accepted * target_frame_size);
+        secondary->backlog_current += accepted;
+        if (accepted < frames)
+        {
+            secondary->dropped_frames += frames - accepted;
+            LOG_DEBUG("Secondary destination device %s is too slow, frames were dropped (dropped frames=%lu)", secondary->device, frames - accepted);
+        }
+
+        /* writing as much as the destination accepts without waiting */
+        result = snd_pcm_writei(secondary->pcm_handle, secondary->backlog, secondary->backlog_current);
+        if (result == -EAGAIN)
+        {
+            continue;
+        }
+        if (result < 0)
+        {
+            if ((result = snd_pcm_recover(secondary->pcm_handle, result, 1)) < 0)
+            {
+                LOG_WARNING("Secondary destination device %s could not be recovered and will not be used: %s", secondary->device, snd_strerror(result));
+                snd_pcm_close(secondary->pcm_handle);
+                secondary->pcm_handle = NULL;
+            }
+            continue;
+        }
+
+        /* moving reminder of the backlog to the beginning */
+        if (result < secondary->backlog_current)
+        {
+            memmove(secondary->backlog, secondary->backlog + result * target_frame_size, (secondary->backlog_current - result) * target_frame_size);
+        }
+        secondary->backlog_current -= result;
+    }
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2017, Andrej Kislovskij
+ *
+ * This is PUBLIC DOMAIN software so use at your own risk as it comes
+ * with no warranties. This code is yours to share, use and modify without
+ * any restrictions or obligations.
+ *
+ * For more information see conwrap/LICENSE or refer refer to http://unlicense.org
+ *
+ * Author: gimesketvirtadieni at gmail dot com (Andrej Kislovskij)
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+
+/*
+ * Static user-space tracepoints (USDT) on the delivery path; provider name is 'slimplexor'.
+ * A disabled probe is a single NOP instruction, so they are always compiled in when <sys/sdt.h> is available
+ * (package systemtap-sdt-dev); defining NO_PROBES removes them completely.
+ *
+ * Example: bpftrace -e 'usdt:/usr/lib/alsa-lib/libasound_module_pcm_slimplexor.so:slimplexor:write_done { @[arg0 < 0] = count(); }'
+ */
+#if !defined(NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBES_ENABLED
+#endif
+#endif
+
+#ifdef PROBES_ENABLED
+#define PROBE1(name, a)       DTRACE_PROBE1(slimplexor, name, a)
+#define PROBE2(name, a, b)    DTRACE_PROBE2(slimplexor, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(slimplexor, name, a, b, c)
+#else
+#define PROBE1(name, a)       do { (void)sizeof(a); } while (0)
+#define PROBE2(name, a, b)    do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define PROBE3(name, a, b, c) do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); } while (0)
+#endif
+
+
+/* probes and their arguments */
+#define PROBE_TRANSFER_ENTRY(frames, offset)       PROBE2(transfer_entry, frames, offset)       /* frames provided by application, ALSA buffer pointer */
+#define PROBE_TRANSFER_RETURN(frames, offset)      PROBE2(transfer_return, frames, offset)      /* frames consumed, ALSA buffer pointer */
+#define PROBE_CONVERT_START(frames, pending)       PROBE2(convert_start, frames, pending)       /* frames to convert, frames already pending */
+#define PROBE_CONVERT_DONE(frames, pending)        PROBE2(convert_done, frames, pending)        /* frames converted, frames pending */
+#define PROBE_WRITE_START(frames, offset)          PROBE2(write_start, frames, offset)          /* frames to be written to loopback, ALSA buffer pointer */
+#define PROBE_WRITE_DONE(result, offset)           PROBE2(write_done, result, offset)           /* frames written or negative error, ALSA buffer pointer */
+#define PROBE_WRITE_PARTIAL(written, requested)    PROBE2(write_partial, written, requested)
+#define PROBE_WRITE_AGAIN(frames)                  PROBE1(write_again, frames)                  /* -EAGAIN, frames still pending */
+#define PROBE_XRUN_RECOVERY(error, result, time)   PROBE3(xrun_recovery, error, result, time)   /* write error, recovery result, recovery time in microseconds */
+#define PROBE_MARKER(value, offset)                PROBE2(marker, value, offset)                /* marker value, ALSA buffer pointer */
+#define PROBE_METERS(peak, rms)                    PROBE2(meters, peak, rms)                    /* levels of the first channel at the end of metering window */
+
+
+#endif  /* PROBES_H */
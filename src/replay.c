@@ -0,0 +1,591 @@
+/*
+ * Copyright 2017, Andrej Kislovskij
+ *
+ * This is PUBLIC DOMAIN software so use at your own risk as it comes
+ * with no warranties. This code is yours to share, use and modify without
+ * any restrictions or obligations.
+ *
+ * For more information see conwrap/LICENSE or refer refer to http://unlicense.org
+ *
+ * Author: gimesketvirtadieni at gmail dot com (Andrej Kislovskij)
+ */
+
+/*
+ * slimplexor-replay reads a PCM dump written by SlimPlexor (see pcm_dump_file option) and replays it
+ * through the same conversion and delivery routines used by the plugin.
+ *
+ * Dump file contains destination frames (PCM channels plus one metadata channel) as they were written to the loopback.
+ * Optional info file (dump file name + ".info") contains one line per event:
+ *
+ *   begin offset=<byte offset> format=<source format> rate=<rate> channels=<channels> dst_format=<format> dst_channels=<channels>
+ *   marker offset=<byte offset> value=<marker>
+ *
+ * Source frames are restored from data frames and fed in chunks (interleaved or planar) to transfer_frames, marker blocks are
+ * replayed with write_stream_marker. Throughput, per-call latency distribution and output checksum are reported.
+ */
+
+#include <getopt.h>
+#include <unistd.h>  /* usleep(...) */
+#include "slimplexor.h"
+
+
+/* replay uses its own logging settings */
+__thread unsigned int log_level = 2;
+__thread FILE*        log_file  = NULL;
+
+
+typedef struct replay_stream
+{
+    long             offset;
+    snd_pcm_format_t format;
+    unsigned int     rate;
+    unsigned int     channels;
+    snd_pcm_format_t dst_format;
+} replay_stream_t;
+
+
+typedef struct replay_marker
+{
+    long         offset;
+    unsigned int value;
+} replay_marker_t;
+
+
+typedef struct replay_stats
+{
+    unsigned long long frames;
+    unsigned long long calls;
+    unsigned long long marker_mismatches;
+    unsigned long long checksum;
+    unsigned int*      latencies;
+    size_t             latencies_size;
+    size_t             latencies_capacity;
+} replay_stats_t;
+
+
+static void add_latency(replay_stats_t* stats, unsigned int latency)
+{
+    if (stats->latencies_size == stats->latencies_capacity)
+    {
+        size_t        capacity  = stats->latencies_capacity ? stats->latencies_capacity * 2 : 4096;
+        unsigned int* latencies = realloc(stats->latencies, capacity * sizeof(unsigned int));
+        if (!latencies)
+        {
+            return;
+        }
+        stats->latencies          = latencies;
+        stats->latencies_capacity = capacity;
+    }
+    stats->latencies[stats->latencies_size++] = latency;
+}
+
+
+static int compare_latencies(const void* a, const void* b)
+{
+    unsigned int x = *(const unsigned int*)a;
+    unsigned int y = *(const unsigned int*)b;
+
+    return (x > y) - (x < y);
+}
+
+
+/* FNV-1a hash over everything produced by the conversion */
+static unsigned long long update_checksum(unsigned long long checksum, unsigned char* data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        checksum ^= data[i];
+        checksum *= 0x100000001b3ULL;
+    }
+
+    return checksum;
+}
+
+
+static int read_info_file(const char* file_name, replay_stream_t** streams, size_t* streams_size, replay_marker_t** markers, size_t* markers_size)
+{
+    int    error = 0;
+    FILE*  file;
+    char   line[256];
+    char   format[32];
+    char   dst_format[32];
+    size_t streams_capacity = 0;
+    size_t markers_capacity = 0;
+
+    if (!(file = fopen(file_name, "r")))
+    {
+        return -errno;
+    }
+
+    while (fgets(line, sizeof(line), file))
+    {
+        replay_stream_t stream;
+        replay_marker_t marker;
+        unsigned int    dst_channels;
+
+        if (sscanf(line, "begin offset=%ld format=%31s rate=%u channels=%u dst_format=%31s dst_channels=%u",
+                   &stream.offset, format, &stream.rate, &stream.channels, dst_format, &dst_channels) == 6)
+        {
+            stream.format     = snd_pcm_format_value(format);
+            stream.dst_format = snd_pcm_format_value(dst_format);
+
+            /* downmixed streams are replayed as already mixed stereo source as original channels cannot be restored */
+            if (dst_channels != stream.channels + 1)
+            {
+                LOG_WARNING("Stream at offset=%ld was downmixed from %u channels, replaying %u channels instead", stream.offset, stream.channels, dst_channels - 1);
+                stream.channels = dst_channels - 1;
+            }
+            if (*streams_size == streams_capacity)
+            {
+                size_t           capacity = streams_capacity ? streams_capacity * 2 : 16;
+                replay_stream_t* resized  = realloc(*streams, capacity * sizeof(replay_stream_t));
+
+                if (!resized)
+                {
+                    error = -ENOMEM;
+                    LOG_ERROR("Could not allocate memory for stream list (requested %lu bytes)", capacity * sizeof(replay_stream_t));
+                    break;
+                }
+                *streams         = resized;
+                streams_capacity = capacity;
+            }
+            (*streams)[(*streams_size)++] = stream;
+        }
+        else if (sscanf(line, "marker offset=%ld value=%u", &marker.offset, &marker.value) == 2)
+        {
+            if (*markers_size == markers_capacity)
+            {
+                size_t           capacity = markers_capacity ? markers_capacity * 2 : 64;
+                replay_marker_t* resized  = realloc(*markers, capacity * sizeof(replay_marker_t));
+
+                if (!resized)
+                {
+                    error = -ENOMEM;
+                    LOG_ERROR("Could not allocate memory for marker list (requested %lu bytes)", capacity * sizeof(replay_marker_t));
+                    break;
+                }
+                *markers         = resized;
+                markers_capacity = capacity;
+            }
+            (*markers)[(*markers_size)++] = marker;
+        }
+    }
+    fclose(file);
+
+    /* partially read lists are released, so entries are never silently dropped */
+    if (error)
+    {
+        free(*streams);
+        free(*markers);
+        *streams      = NULL;
+        *markers      = NULL;
+        *streams_size = 0;
+        *markers_size = 0;
+    }
+
+    return error;
+}
+
+
+/* reverse of convert_channel: restoring source sample from a destination sample */
+static void restore_sample(snd_pcm_format_t format, size_t sample_size, unsigned char* target_sample, size_t target_sample_size, unsigned char* source_sample)
+{
+    switch (format)
+    {
+        case SND_PCM_FORMAT_S24_LE:
+            for (unsigned int s = 0; s < 3; s++)
+            {
+                source_sample[s] = target_sample[s + 1];
+            }
+            source_sample[3] = (target_sample[3] & 0x80) ? 0xFF : 0x00;
+            break;
+        default:
+            for (unsigned int s = 0; s < sample_size; s++)
+            {
+                source_sample[s] = target_sample[target_sample_size - sample_size + s];
+            }
+            break;
+    }
+}
+
+
+static int start_stream(plugin_data_t* plugin_data, replay_stream_t* stream, char* device, snd_pcm_uframes_t period_size)
+{
+    int error = 0;
+
+    plugin_data->alsa_data.rate     = stream->rate;
+    plugin_data->alsa_data.channels = stream->channels;
+    plugin_data->dst_channels       = stream->channels + 1;
+    plugin_data->src_format         = stream->format;
+    plugin_data->dst_format         = stream->dst_format;
+    plugin_data->dst_device         = device;
+    plugin_data->dst_period_size    = period_size;
+    plugin_data->dst_periods        = PERIODS;
+
+    if (!error)
+    {
+        error = open_destination_device(plugin_data);
+    }
+    if (!error)
+    {
+        error = set_dst_sw_params(plugin_data, NULL);
+    }
+    if (!error)
+    {
+        if ((error = snd_pcm_prepare(plugin_data->dst_pcm_handle)) < 0)
+        {
+            LOG_ERROR("Error while preparing destination device: %s", snd_strerror(error));
+        }
+    }
+
+    return error;
+}
+
+
+static void stop_stream(plugin_data_t* plugin_data)
+{
+    drain_destination_device(plugin_data);
+    close_destination_device(plugin_data);
+}
+
+
+static void update_converted_checksum(void* context, unsigned char* frames, size_t size)
+{
+    replay_stats_t* stats = (replay_stats_t*)context;
+
+    stats->checksum = update_checksum(stats->checksum, frames, size);
+}
+
+
+/* plays the role of ALSA: transfer is called with the rest of the chunk until all frames are consumed */
+static void transfer(plugin_data_t* plugin_data, const snd_pcm_channel_area_t* areas, snd_pcm_uframes_t frames, replay_stats_t* stats, int real_time, unsigned long long* paced_frames, unsigned long long started_at)
+{
+    snd_pcm_uframes_t offset = 0;
+
+    while (frames > 0)
+    {
+        unsigned long long call_started_at    = get_time_us();
+        snd_pcm_uframes_t  frames_processable = transfer_frames(plugin_data, areas, offset, frames, 0, update_converted_checksum, stats);
+
+        add_latency(stats, (unsigned int)(get_time_us() - call_started_at));
+        stats->calls++;
+        stats->frames += frames_processable;
+
+        /* giving up on the rest of the chunk if the destination device does not accept data */
+        if (!frames_processable && plugin_data->dst_buffer_current >= plugin_data->dst_buffer_size)
+        {
+            break;
+        }
+
+        offset += frames_processable;
+        frames -= frames_processable;
+
+        /* pacing delivery to the sample rate if real-time replay was requested */
+        *paced_frames += frames_processable;
+        if (real_time)
+        {
+            unsigned long long due_at = started_at + *paced_frames * 1000000ULL / plugin_data->alsa_data.rate;
+            unsigned long long now    = get_time_us();
+            if (due_at > now)
+            {
+                usleep(due_at - now);
+            }
+        }
+    }
+}
+
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [options] <dump file>\n", name);
+    fprintf(stderr, "  -D <device>   destination device (default: null)\n");
+    fprintf(stderr, "  -p <frames>   chunk size used for replay, as well as destination period size (default: 2048)\n");
+    fprintf(stderr, "  -r            replay at real-time pace instead of as fast as possible\n");
+    fprintf(stderr, "  -l <ms>       write coalescing latency (default: 0, coalescing is disabled)\n");
+    fprintf(stderr, "  -f <format>   source format if there is no info file (default: S32_LE)\n");
+    fprintf(stderr, "  -c <channels> source channels if there is no info file (default: 2)\n");
+    fprintf(stderr, "  -s <rate>     source rate if there is no info file (default: 44100)\n");
+    fprintf(stderr, "  -n            dump was written with native_width enabled if there is no info file\n");
+    fprintf(stderr, "  -P            feed source frames as non-interleaved (planar) buffers\n");
+    fprintf(stderr, "  -v            verbose logging\n");
+}
+
+
+int main(int argc, char* argv[])
+{
+    int                error          = 0;
+    char*              device         = "null";
+    snd_pcm_uframes_t  period_size    = 2048;
+    int                real_time      = 0;
+    long               coalesce       = 0;
+    int                native_width   = 0;
+    replay_stream_t    default_stream = {0, SND_PCM_FORMAT_S32_LE, 44100, 2, TARGET_FORMAT};
+    replay_stream_t*   streams        = NULL;
+    size_t             streams_size   = 0;
+    replay_marker_t*   markers        = NULL;
+    size_t             markers_size   = 0;
+    size_t             next_stream    = 0;
+    size_t             next_marker    = 0;
+    replay_stats_t     stats;
+    plugin_data_t      plugin_data;
+    FILE*              dump_file      = NULL;
+    char*              info_file_name = NULL;
+    unsigned char*     frame          = NULL;
+    unsigned char*     chunk          = NULL;
+    snd_pcm_channel_area_t areas[MAX_SOURCE_CHANNELS];
+    int                planar         = 0;
+    snd_pcm_uframes_t  chunk_frames   = 0;
+    unsigned int       last_marker    = 0;
+    long               offset         = 0;
+    unsigned long long paced_frames   = 0;
+    unsigned long long started_at;
+    unsigned long long stream_started_at;
+    int                option;
+
+    memset(&stats, 0, sizeof(stats));
+    memset(&plugin_data, 0, sizeof(plugin_data));
+
+    log_file       = stderr;
+    stats.checksum = 0xcbf29ce484222325ULL;
+
+    while ((option = getopt(argc, argv, "D:p:rl:f:c:s:nPv")) != -1)
+    {
+        switch (option)
+        {
+            case 'D':
+                device = optarg;
+                break;
+            case 'p':
+                period_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                real_time = 1;
+                break;
+            case 'l':
+                coalesce = strtol(optarg, NULL, 10);
+                break;
+            case 'f':
+                default_stream.format = snd_pcm_format_value(optarg);
+                break;
+            case 'c':
+                default_stream.channels = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                default_stream.rate = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                native_width = 1;
+                break;
+            case 'P':
+                planar = 1;
+                break;
+            case 'v':
+                log_level = 4;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc || !period_size || coalesce < 0 || default_stream.format == SND_PCM_FORMAT_UNKNOWN || !default_stream.channels || !default_stream.rate)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* opening dump file and reading its info file if present */
+    if (!(dump_file = fopen(argv[optind], "r")))
+    {
+        error = -errno;
+        LOG_ERROR("Could not open dump file (error=%s, file name=%s)", strerror(errno), argv[optind]);
+    }
+    if (!error)
+    {
+        info_file_name = malloc(strlen(argv[optind]) + sizeof(PCM_DUMP_INFO_SUFFIX));
+        if (!info_file_name)
+        {
+            error = -ENOMEM;
+        }
+        else
+        {
+            strcpy(info_file_name, argv[optind]);
+            strcat(info_file_name, PCM_DUMP_INFO_SUFFIX);
+            if ((error = read_info_file(info_file_name, &streams, &streams_size, &markers, &markers_size)) == -ENOENT)
+            {
+                LOG_WARNING("Info file was not found, using default stream parameters");
+                error = 0;
+            }
+            else if (error < 0)
+            {
+                LOG_ERROR("Could not read info file (error=%s, file name=%s)", strerror(-error), info_file_name);
+            }
+        }
+    }
+
+    plugin_data.coalesce_latency = coalesce;
+    started_at                   = get_time_us();
+    stream_started_at            = started_at;
+
+    /* the same way as plugin chooses destination format */
+    if (native_width && (default_stream.format == SND_PCM_FORMAT_S8 || default_stream.format == SND_PCM_FORMAT_S16_LE))
+    {
+        default_stream.dst_format = NATIVE_WIDTH_FORMAT;
+    }
+
+    replay_stream_t* stream = (streams_size ? NULL : &default_stream);
+    while (!error)
+    {
+        /* switching to the next stream described by the info file */
+        if (next_stream < streams_size && streams[next_stream].offset <= offset)
+        {
+            if (plugin_data.dst_pcm_handle && chunk_frames)
+            {
+                transfer(&plugin_data, areas, chunk_frames, &stats, real_time, &paced_frames, stream_started_at);
+                chunk_frames = 0;
+            }
+            stop_stream(&plugin_data);
+            stream = &streams[next_stream++];
+            free(frame);
+            free(chunk);
+            frame = NULL;
+            chunk = NULL;
+        }
+        if (!stream)
+        {
+            LOG_ERROR("Dump file does not start with a stream described in the info file");
+            error = -EINVAL;
+            break;
+        }
+
+        size_t sample_size        = snd_pcm_format_physical_width(stream->format) >> 3;
+        size_t target_sample_size = snd_pcm_format_physical_width(stream->dst_format) >> 3;
+        size_t target_frame_size  = target_sample_size * (stream->channels + 1);
+
+        /* buffers for one destination frame and one chunk of source frames */
+        if (!frame || !chunk)
+        {
+            frame = malloc(target_frame_size);
+            chunk = malloc(period_size * sample_size * stream->channels);
+            if (!frame || !chunk || stream->channels > MAX_SOURCE_CHANNELS)
+            {
+                error = -ENOMEM;
+                break;
+            }
+
+            /* channel areas the same way as ALSA provides them to transfer callback */
+            for (unsigned int c = 0; c < stream->channels; c++)
+            {
+                areas[c].addr  = chunk;
+                areas[c].first = (planar ? c * period_size : c) * sample_size * 8;
+                areas[c].step  = (planar ? 1 : stream->channels) * sample_size * 8;
+            }
+        }
+
+        if (!plugin_data.dst_pcm_handle)
+        {
+            if ((error = start_stream(&plugin_data, stream, device, period_size)) < 0)
+            {
+                break;
+            }
+            paced_frames      = 0;
+            stream_started_at = get_time_us();
+        }
+
+        if (fread(frame, target_frame_size, 1, dump_file) != 1)
+        {
+            break;
+        }
+
+        /* cross-checking marker timeline from info file with the dump content */
+        unsigned int marker = frame[target_frame_size - 1];
+        while (next_marker < markers_size && markers[next_marker].offset < offset)
+        {
+            next_marker++;
+        }
+        if (next_marker < markers_size && markers[next_marker].offset == offset && markers[next_marker].value != marker)
+        {
+            stats.marker_mismatches++;
+        }
+
+        if (marker == DATA_MARKER)
+        {
+            for (unsigned int c = 0; c < stream->channels; c++)
+            {
+                restore_sample(stream->format, sample_size, frame + c * target_sample_size, target_sample_size, chunk + (planar ? c * period_size + chunk_frames : chunk_frames * stream->channels + c) * sample_size);
+            }
+            if (++chunk_frames == period_size)
+            {
+                transfer(&plugin_data, areas, chunk_frames, &stats, real_time, &paced_frames, stream_started_at);
+                chunk_frames = 0;
+            }
+        }
+        else
+        {
+            if (chunk_frames)
+            {
+                transfer(&plugin_data, areas, chunk_frames, &stats, real_time, &paced_frames, stream_started_at);
+                chunk_frames = 0;
+            }
+
+            /* marker block is replayed once; beginning of stream is written by transfer */
+            if (marker != last_marker || marker == TRACK_BOUNDARY_MARKER)
+            {
+                if (marker == END_OF_STREAM_MARKER)
+                {
+                    stop_stream(&plugin_data);
+                }
+                else if (marker == TRACK_BOUNDARY_MARKER && plugin_data.transfer_started)
+                {
+                    write_stream_marker(&plugin_data, TRACK_BOUNDARY_MARKER);
+                }
+            }
+        }
+
+        last_marker  = marker;
+        offset      += target_frame_size;
+    }
+
+    if (!error && chunk_frames)
+    {
+        transfer(&plugin_data, areas, chunk_frames, &stats, real_time, &paced_frames, stream_started_at);
+    }
+    stop_stream(&plugin_data);
+
+    /* reporting results */
+    if (!error)
+    {
+        unsigned long long elapsed = get_time_us() - started_at;
+
+        fprintf(stdout, "frames:            %llu\n", stats.frames);
+        fprintf(stdout, "transfer calls:    %llu\n", stats.calls);
+        fprintf(stdout, "write errors:      %lu\n", plugin_data.write_errors);
+        fprintf(stdout, "marker mismatches: %llu\n", stats.marker_mismatches);
+        fprintf(stdout, "elapsed:           %.3f s\n", elapsed / 1000000.0);
+        if (elapsed)
+        {
+            fprintf(stdout, "throughput:        %.0f frames/s\n", stats.frames * 1000000.0 / elapsed);
+        }
+        if (stats.latencies_size)
+        {
+            qsort(stats.latencies, stats.latencies_size, sizeof(unsigned int), compare_latencies);
+            fprintf(stdout, "latency p50:       %u us\n", stats.latencies[stats.latencies_size / 2]);
+            fprintf(stdout, "latency p90:       %u us\n", stats.latencies[stats.latencies_size * 9 / 10]);
+            fprintf(stdout, "latency p99:       %u us\n", stats.latencies[stats.latencies_size * 99 / 100]);
+            fprintf(stdout, "latency max:       %u us\n", stats.latencies[stats.latencies_size - 1]);
+        }
+        fprintf(stdout, "output checksum:   %016llx\n", stats.checksum);
+    }
+
+    if (dump_file)
+    {
+        fclose(dump_file);
+    }
+    free(info_file_name);
+    free(frame);
+    free(chunk);
+    free(streams);
+    free(markers);
+    free(stats.latencies);
+
+    return error ? 1 : 0;
+}
@@ -10,43 +10,217 @@
  * Author: gimesketvirtadieni at gmail dot com (Andrej Kislovskij)
  */
 
+#include <string.h>  /* strerror(...) */
 #include <unistd.h>  /* fsync(...) */
 #include "slimplexor.h"
 
 
 /* define the default logging level (0 - NONE, 1 - ERROR, 2 - WARNING, 3 - INFO, 4 - DEBUG) */
-unsigned int log_level          = 3;
-FILE*        log_file           = NULL;
-FILE*        pcm_dump_file      = NULL;
-char*        pcm_dump_file_name = NULL;
+static const unsigned int default_log_level = 3;
 
+/* logging settings are configured per plugin instance; these hold settings of the instance the calling thread works for */
+__thread unsigned int log_level = 0;
+__thread FILE*        log_file  = NULL;
 
-static int callback_close(snd_pcm_ioplug_t *io)
+/* configuration parsed once per process and shared by all plugin instances opened with it */
+typedef struct plugin_config
 {
-    LOG_DEBUG("Close stream callback was invoked");
+    char*                 key;                 /* serialized ALSA configuration node */
+    unsigned int          log_level;
+    FILE*                 log_file;
+    char*                 pcm_dump_file_name;
+    plugin_data_t         template;            /* configured settings every plugin instance starts with */
+    struct plugin_config* next;
+} plugin_config_t;
+
+/* serializes access to parsed configurations when plugin instances are opened concurrently */
+static pthread_mutex_t  config_lock = PTHREAD_MUTEX_INITIALIZER;
+static plugin_config_t* configs     = NULL;
+
+/* amount of plugin instances opened by this process so far */
+static uint32_t instances = 0;
+
+/* used unless rate_device_map is defined in configuration */
+static const rate_device_map_t default_rate_device_map[] =
+{
+    {.rate = 8000,   .device = "hw:1,0,1"},
+    {.rate = 11025,  .device = "hw:1,0,2"},
+    {.rate = 12000,  .device = "hw:1,0,3"},
+    {.rate = 16000,  .device = "hw:1,0,4"},
+    {.rate = 22500,  .device = "hw:1,0,5"},
+    {.rate = 24000,  .device = "hw:1,0,6"},
+    {.rate = 32000,  .device = "hw:1,0,7"},
+    {.rate = 44100,  .device = "hw:2,0,1"},
+    {.rate = 48000,  .device = "hw:2,0,2"},
+    {.rate = 88200,  .device = "hw:2,0,3"},
+    {.rate = 96000,  .device = "hw:2,0,4"},
+    {.rate = 176400, .device = "hw:2,0,5"},
+    {.rate = 192000, .device = "hw:2,0,6"},
+};
 
-    plugin_data_t* plugin_data = (plugin_data_t*)io->private_data;
 
-    if (plugin_data->dst_pcm_handle)
+/* waits until blocking I/O started by another callback is over; caller must hold the instance lock */
+static void wait_for_io(plugin_data_t* plugin_data)
+{
+    while (plugin_data->io_busy)
+    {
+        pthread_cond_wait(&plugin_data->io_done, &plugin_data->lock);
+    }
+}
+
+
+/* claims the destination for blocking I/O and releases the instance lock, so pointer, delay and poll callbacks are not stalled by a full loopback */
+static void begin_io(plugin_data_t* plugin_data)
+{
+    wait_for_io(plugin_data);
+    plugin_data->io_busy = 1;
+    pthread_mutex_unlock(&plugin_data->lock);
+}
+
+
+/* takes the instance lock back once blocking I/O is over */
+static void end_io(plugin_data_t* plugin_data)
+{
+    pthread_mutex_lock(&plugin_data->lock);
+    plugin_data->io_busy = 0;
+    pthread_cond_broadcast(&plugin_data->io_done);
+}
+
+
+/* writes coalesced frames once their latency deadline passes, so they are delivered even if application stops writing and polling */
+static void* coalesce_thread(void* arg)
+{
+    plugin_data_t*     plugin_data = (plugin_data_t*)arg;
+    struct timespec    deadline;
+    unsigned long long elapsed_us;
+
+    set_logging(plugin_data);
+
+    pthread_mutex_lock(&plugin_data->lock);
+    while (!plugin_data->coalesce_thread_stop)
     {
-        /* if there PCM data transfer was actually started then marking the end of stream and draining buffer */
-        if (plugin_data->transfer_started)
+        if (plugin_data->io_busy || !plugin_data->dst_pcm_handle || !plugin_data->dst_buffer_current)
+        {
+            /* every transfer ends with io_done broadcast, which is when new frames may be pending */
+            pthread_cond_wait(&plugin_data->io_done, &plugin_data->lock);
+        }
+        else if (!is_write_due(plugin_data))
+        {
+            elapsed_us = get_time_us() - plugin_data->coalesce_started_at;
+            get_deadline(&deadline, plugin_data->coalesce_latency - elapsed_us / 1000);
+            pthread_cond_timedwait(&plugin_data->io_done, &plugin_data->lock, &deadline);
+        }
+        else
         {
-            write_stream_marker(plugin_data, END_OF_STREAM_MARKER);
+            begin_io(plugin_data);
+            snd_pcm_sframes_t result = write_to_dst(plugin_data);
+            if (result < 0)
+            {
+                LOG_ERROR("Error while writting to target device: %s", snd_strerror(result));
+            }
+            end_io(plugin_data);
 
-            int tmp;
-            if ((tmp = snd_pcm_drain(plugin_data->dst_pcm_handle)) < 0)
+            /* failed frames stay pending, so retrying is left to the next transfer instead of spinning here */
+            if (result < 0 && !plugin_data->coalesce_thread_stop)
             {
-                LOG_WARNING("Error while draining target device: %s", snd_strerror(tmp));
+                pthread_cond_wait(&plugin_data->io_done, &plugin_data->lock);
             }
-            plugin_data->transfer_started = 0;
+        }
+    }
+    pthread_mutex_unlock(&plugin_data->lock);
+
+    return NULL;
+}
+
+
+static void start_coalesce_thread(plugin_data_t* plugin_data)
+{
+    int error;
+
+    plugin_data->coalesce_thread_stop    = 0;
+    plugin_data->coalesce_thread_running = 0;
+
+    if (!plugin_data->coalesce_latency)
+    {
+        return;
+    }
+
+    /* without the thread frames are still written by the next transfer, drain or close */
+    if ((error = pthread_create(&plugin_data->coalesce_thread, NULL, coalesce_thread, plugin_data)))
+    {
+        LOG_WARNING("Could not start write coalescing thread: %s", strerror(error));
+    }
+    else
+    {
+        plugin_data->coalesce_thread_running = 1;
+    }
+}
+
+
+static void stop_coalesce_thread(plugin_data_t* plugin_data)
+{
+    if (!plugin_data->coalesce_thread_running)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&plugin_data->lock);
+    plugin_data->coalesce_thread_stop = 1;
+    pthread_cond_broadcast(&plugin_data->io_done);
+    pthread_mutex_unlock(&plugin_data->lock);
+
+    pthread_join(plugin_data->coalesce_thread, NULL);
+    plugin_data->coalesce_thread_running = 0;
+}
+
+
+static int callback_close(snd_pcm_ioplug_t *io)
+{
+    plugin_data_t* plugin_data = (plugin_data_t*)io->private_data;
+
+    set_logging(plugin_data);
+    LOG_DEBUG("Close stream callback was invoked");
+
+    /* pending frames are flushed by drain below, so the deadline writer is not needed anymore */
+    stop_coalesce_thread(plugin_data);
+
+    pthread_mutex_lock(&plugin_data->lock);
+    wait_for_io(plugin_data);
+
+    if (plugin_data->dst_pcm_handle)
+    {
+        /* handing destination device over to a background drainer so close does not block; stream is parked if gapless mode is on */
+        if ((plugin_data->background_drain || plugin_data->gapless_window > 0) && plugin_data->transfer_started &&
+            !drain_destination_device_in_background(plugin_data, plugin_data->gapless_window))
+        {
+            LOG_DEBUG("Destination device was handed over to background drain");
+        }
+        else
+        {
+            begin_io(plugin_data);
+            drain_destination_device(plugin_data);
+            end_io(plugin_data);
         }
 
         /* closing destination device which will release relevant resources */
         close_destination_device(plugin_data);
     }
 
-    /* log file is flushed instead of closing it to be able to log in case of multiple calls to ALSA close routine */
+    /* letting another plugin instance publish meters */
+    release_meters(plugin_data);
+
+    /* application thread which was delivering data gets its scheduling settings back */
+    restore_realtime_scheduling(plugin_data);
+
+    pthread_mutex_unlock(&plugin_data->lock);
+    pthread_cond_destroy(&plugin_data->io_done);
+    pthread_mutex_destroy(&plugin_data->lock);
+
+    /* volume control mapping, rate map and log file are shared by plugin instances, so only plugin data is released */
+    free(plugin_data);
+
+    /* log file is flushed instead of closing it as it is shared by plugin instances */
+    fflush(log_file);
     fsync(fileno(log_file));
 
     /* close routine may not fail */
@@ -54,59 +228,205 @@ static int callback_close(snd_pcm_ioplug_t *io)
 }
 
 
+static int callback_delay(snd_pcm_ioplug_t *io, snd_pcm_sframes_t *delayp)
+{
+    int               error       = 0;
+    plugin_data_t*    plugin_data = (plugin_data_t*)io->private_data;
+    snd_pcm_sframes_t dst_delay   = 0;
+    snd_pcm_uframes_t pending;
+
+    set_logging(plugin_data);
+
+    /* destination handle is only replaced while the lock is held, so it is safe to query while a write is in progress */
+    pthread_mutex_lock(&plugin_data->lock);
+
+    /* frames buffered by the loopback device are still to be played */
+    if (plugin_data->dst_pcm_handle && (error = snd_pcm_delay(plugin_data->dst_pcm_handle, &dst_delay)) < 0)
+    {
+        /* underrun means there is nothing buffered in the loopback and the next write will recover from it */
+        if (error != -EPIPE)
+        {
+            LOG_WARNING("Could not get delay of destination device: %s", snd_strerror(error));
+        }
+        dst_delay = 0;
+        error     = 0;
+    }
+
+    /* frames pending in the transfer buffer were already reported as consumed by the transfer callback */
+    pending = __atomic_load_n(&plugin_data->dst_buffer_current, __ATOMIC_RELAXED);
+    *delayp = dst_delay + pending;
+
+    LOG_DEBUG("Delay callback was called (destination delay=%ld, pending frames=%ld)", dst_delay, pending);
+
+    pthread_mutex_unlock(&plugin_data->lock);
+
+    return error;
+}
+
+
+static int callback_drain(snd_pcm_ioplug_t *io)
+{
+    plugin_data_t*    plugin_data = (plugin_data_t*)io->private_data;
+    snd_pcm_sframes_t result      = 0;
+
+    set_logging(plugin_data);
+    LOG_DEBUG("Drain callback was invoked");
+
+    pthread_mutex_lock(&plugin_data->lock);
+    begin_io(plugin_data);
+
+    /* flushing frames held back by write coalescing, otherwise pointer would never reach application pointer */
+    while (plugin_data->dst_pcm_handle && plugin_data->dst_buffer_current > 0 && result >= 0)
+    {
+        if ((result = write_to_dst(plugin_data)) < 0)
+        {
+            LOG_ERROR("Error while writting to target device: %s", snd_strerror(result));
+        }
+    }
+
+    end_io(plugin_data);
+    pthread_mutex_unlock(&plugin_data->lock);
+
+    return 0;
+}
+
+
 static int callback_hw_params(snd_pcm_ioplug_t *io, snd_pcm_hw_params_t *params)
 {
+    plugin_data_t* plugin_data = (plugin_data_t*)io->private_data;
+
+    set_logging(plugin_data);
     LOG_DEBUG("HW parameters setup callback was invoked");
 
-    plugin_data_t* plugin_data = (plugin_data_t*)io->private_data;
+    pthread_mutex_lock(&plugin_data->lock);
+    wait_for_io(plugin_data);
 
     /* closing the target device first to allow multiple calls to snd_pcm_hw_params / snd_pcm_prepare */
     close_destination_device(plugin_data);
 
     /* setting up target device hardware parameters */
-    return set_dst_hw_params(plugin_data, params);
+    int error = set_dst_hw_params(plugin_data, params);
+
+    pthread_mutex_unlock(&plugin_data->lock);
+
+    return error;
 }
 
 
 static snd_pcm_sframes_t callback_pointer(snd_pcm_ioplug_t *io)
 {
+    plugin_data_t*    plugin_data = (plugin_data_t*)io->private_data;
+    snd_pcm_sframes_t pointer;
+
+    /* pointer is polled often, so it is read without taking the lock; writes wrap and update it atomically */
+    pointer = __atomic_load_n(&plugin_data->pointer, __ATOMIC_RELAXED);
+
+    set_logging(plugin_data);
+    LOG_DEBUG("Pointer change callback was called (pointer=%ld, buffer size=%ld)", pointer, io->buffer_size);
+
+    return pointer;
+}
+
+
+static int callback_poll_descriptors_count(snd_pcm_ioplug_t *io)
+{
+    int            count       = 0;
     plugin_data_t* plugin_data = (plugin_data_t*)io->private_data;
 
-    LOG_DEBUG("Pointer change callback was called (pointer=%ld, buffer size=%ld)", plugin_data->pointer, io->buffer_size);
+    pthread_mutex_lock(&plugin_data->lock);
 
-    plugin_data->pointer %= io->buffer_size;
+    /* there is nothing to wait for until destination device is opened */
+    if (plugin_data->dst_pcm_handle)
+    {
+        count = snd_pcm_poll_descriptors_count(plugin_data->dst_pcm_handle);
+    }
+
+    pthread_mutex_unlock(&plugin_data->lock);
 
-    return plugin_data->pointer;
+    return count;
 }
 
 
-static int callback_prepare(snd_pcm_ioplug_t *io)
+static int callback_poll_descriptors(snd_pcm_ioplug_t *io, struct pollfd *pfd, unsigned int space)
 {
-    LOG_DEBUG("Prepare processing callback was invoked");
+    int            count       = 0;
+    plugin_data_t* plugin_data = (plugin_data_t*)io->private_data;
+
+    pthread_mutex_lock(&plugin_data->lock);
+
+    /* destination device descriptors are passed through, so callers wake up exactly when loopback has free space */
+    if (plugin_data->dst_pcm_handle)
+    {
+        count = snd_pcm_poll_descriptors(plugin_data->dst_pcm_handle, pfd, space);
+    }
+
+    pthread_mutex_unlock(&plugin_data->lock);
+
+    return count;
+}
 
+
+static int callback_poll_revents(snd_pcm_ioplug_t *io, struct pollfd *pfd, unsigned int nfds, unsigned short *revents)
+{
     int            error       = 0;
     plugin_data_t* plugin_data = (plugin_data_t*)io->private_data;
 
-    /* resetting hw buffer pointer */
-    plugin_data->pointer = 0;
+    set_logging(plugin_data);
 
-    if (snd_pcm_state(plugin_data->dst_pcm_handle) > SND_PCM_STATE_PREPARED)
+    pthread_mutex_lock(&plugin_data->lock);
+
+    if (!plugin_data->dst_pcm_handle)
     {
-        return error;
+        *revents = 0;
+    }
+    else if ((error = snd_pcm_poll_descriptors_revents(plugin_data->dst_pcm_handle, pfd, nfds, revents)) < 0)
+    {
+        LOG_ERROR("Could not get poll events from destination device: %s", snd_strerror(error));
+    }
+    else if ((*revents & POLLERR) && snd_pcm_state(plugin_data->dst_pcm_handle) == SND_PCM_STATE_XRUN)
+    {
+        /* destination device underrun is recovered by the next write, so it must not be reported as an error to the caller */
+        *revents = (*revents & ~POLLERR) | POLLOUT;
     }
 
-    /* preparing target device and starting playback */
-    if ((error = snd_pcm_prepare(plugin_data->dst_pcm_handle)) < 0)
+    pthread_mutex_unlock(&plugin_data->lock);
+
+    return error;
+}
+
+
+static int callback_prepare(snd_pcm_ioplug_t *io)
+{
+    int            error       = 0;
+    plugin_data_t* plugin_data = (plugin_data_t*)io->private_data;
+
+    set_logging(plugin_data);
+    LOG_DEBUG("Prepare processing callback was invoked");
+
+    pthread_mutex_lock(&plugin_data->lock);
+    wait_for_io(plugin_data);
+
+    /* resetting hw buffer pointer */
+    __atomic_store_n(&plugin_data->pointer, 0, __ATOMIC_RELAXED);
+
+    /* preparing target device and starting playback unless it is already running */
+    if (snd_pcm_state(plugin_data->dst_pcm_handle) <= SND_PCM_STATE_PREPARED)
     {
-        LOG_ERROR("Error while preparing destination device: %s", snd_strerror(error));
+        if ((error = snd_pcm_prepare(plugin_data->dst_pcm_handle)) < 0)
+        {
+            LOG_ERROR("Error while preparing destination device: %s", snd_strerror(error));
+        }
     }
 
+    pthread_mutex_unlock(&plugin_data->lock);
+
     return error;
 }
 
 
 static int callback_start(snd_pcm_ioplug_t *io)
 {
+    set_logging((plugin_data_t*)io->private_data);
     LOG_DEBUG("Start processing callback was invoked");
 
     return 0;
@@ -115,6 +435,7 @@ static int callback_start(snd_pcm_ioplug_t *io)
 
 static int callback_stop(snd_pcm_ioplug_t *io)
 {
+    set_logging((plugin_data_t*)io->private_data);
     LOG_DEBUG("Stop processing callback was invoked");
 
     return 0;
@@ -123,79 +444,257 @@ static int callback_stop(snd_pcm_ioplug_t *io)
 
 static int callback_sw_params(snd_pcm_ioplug_t *io, snd_pcm_sw_params_t *params)
 {
+    plugin_data_t* plugin_data = (plugin_data_t*)io->private_data;
+
+    set_logging(plugin_data);
     LOG_DEBUG("SW parameters setup callback was invoked");
 
-    plugin_data_t* plugin_data = (plugin_data_t*)io->private_data;
+    pthread_mutex_lock(&plugin_data->lock);
+    wait_for_io(plugin_data);
+    int error = set_dst_sw_params(plugin_data, params);
+    pthread_mutex_unlock(&plugin_data->lock);
 
-    return set_dst_sw_params(plugin_data, params);
+    return error;
 }
 
 
 static snd_pcm_sframes_t callback_transfer(snd_pcm_ioplug_t *io, const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset, snd_pcm_uframes_t frames_provided)
 {
     plugin_data_t* plugin_data = (plugin_data_t*)io->private_data;
-    unsigned char* pcm_data    = (unsigned char*)areas->addr + (areas->first >> 3) + ((areas->step * offset) >> 3);
+
+    set_logging(plugin_data);
+
+    /* the whole transfer may block on the loopback, so it runs without holding the lock */
+    pthread_mutex_lock(&plugin_data->lock);
+    begin_io(plugin_data);
+    PROBE_TRANSFER_ENTRY(frames_provided, plugin_data->pointer);
+
+    /* delivery happens inline, so real-time settings are applied to the application thread calling transfer */
+    set_realtime_scheduling(plugin_data);
 
     LOG_DEBUG("Data transfer callback was invoked (offset=%lu, frames provided=%lu, frames already present=%ld)", offset, frames_provided, plugin_data->dst_buffer_current);
 
-    /* if this is the first time transfer is called then marking the biginning of PCM stream */
-    if (!plugin_data->transfer_started)
+    /* mmap commit expects all frames to be consumed, otherwise it's ok to process less frames as ALSA will call this callback with the rest of data */
+    int               mmap_access      = (io->access == SND_PCM_ACCESS_MMAP_INTERLEAVED || io->access == SND_PCM_ACCESS_MMAP_NONINTERLEAVED);
+    snd_pcm_uframes_t frames_processed = transfer_frames(plugin_data, areas, offset, frames_provided, mmap_access, NULL, NULL);
+
+    PROBE_TRANSFER_RETURN(frames_processed, plugin_data->pointer);
+    end_io(plugin_data);
+    pthread_mutex_unlock(&plugin_data->lock);
+
+    /* frames are 'consumed' as long as they were coppied to the transfer buffer, even though some are still pending for delivery */
+    return frames_processed;
+}
+
+
+const snd_pcm_ioplug_callback_t callbacks = {
+    .start                  = callback_start,
+    .stop                   = callback_stop,
+    .pointer                = callback_pointer,
+    .close                  = callback_close,
+    .hw_params              = callback_hw_params,
+    .sw_params              = callback_sw_params,
+    .prepare                = callback_prepare,
+    .transfer               = callback_transfer,
+    .poll_descriptors_count = callback_poll_descriptors_count,
+    .poll_descriptors       = callback_poll_descriptors,
+    .poll_revents           = callback_poll_revents,
+    .delay                  = callback_delay,
+    .drain                  = callback_drain,
+};
+
+
+static void free_rate_device(rate_device_map_t* entry)
+{
+    free(entry->device);
+    for (unsigned int j = 0; j < entry->secondary_devices_size; j++)
     {
-        write_stream_marker(plugin_data, BEGINNING_OF_STREAM_MARKER);
-        plugin_data->transfer_started = 1;
+        free(entry->secondary_devices[j]);
     }
+    entry->device                 = NULL;
+    entry->secondary_devices_size = 0;
+}
+
 
-    /* it's ok to process less frames than provided as ALSA will call this callback with the rest of data */
-    /* adjusting amount of frames to be processed, which is max(available,provided) */
-    snd_pcm_uframes_t available_size     = plugin_data->dst_buffer_size - plugin_data->dst_buffer_current;
-    snd_pcm_uframes_t frames_processable = frames_provided;
-    if (available_size < frames_provided)
+static void destroy_config(plugin_config_t* config)
+{
+    if (config->log_file && config->log_file != stdout && config->log_file != stderr)
     {
-        LOG_DEBUG("More frames provided than buffer available (frames provided=%lu, available buffer size=%ld)", frames_provided, available_size);
-        frames_processable = available_size;
+        fclose(config->log_file);
     }
+    close_control(config->template.control);
+    for (unsigned int i = 0; config->template.rate_device_map && i < config->template.rate_device_map_size; i++)
+    {
+        free_rate_device(&config->template.rate_device_map[i]);
+    }
+    free(config->template.rate_device_map);
+    free(config->pcm_dump_file_name);
+    free(config->key);
+    free(config);
+}
 
-    /* copying frames from the source buffer to the target buffer */
-    copy_frames(plugin_data, pcm_data, frames_processable);
 
-    /* writting to the target device */
-    snd_pcm_sframes_t result = write_to_dst(plugin_data);
-    if (result < 0)
+static int add_rate_device(rate_device_map_t* entry, const char* device)
+{
+    char* copy = strdup(device);
+
+    if (!copy)
+    {
+        return -ENOMEM;
+    }
+    if (!entry->device)
     {
-        LOG_ERROR("Error while writting to target device: %s", snd_strerror(result));
+        entry->device = copy;
     }
-    else if (result < frames_processable)
+    else if (entry->secondary_devices_size < MAX_SECONDARY_DEVICES)
     {
-        LOG_WARNING("Less frames were written to the target device than expected (written frames=%ld, expected to write frames=%ld)", result, frames_processable);
+        entry->secondary_devices[entry->secondary_devices_size++] = copy;
+    }
+    else
+    {
+        LOG_WARNING("Ignoring device %s as there are too many devices for sampling rate %u", device, entry->rate);
+        free(copy);
     }
 
-    /* frames are 'consumed' as long as they were coppied to the transfer buffer, even though some are still pending for delivery */
-    return frames_processable;
+    return 0;
 }
 
 
-const snd_pcm_ioplug_callback_t callbacks = {
-    .start     = callback_start,
-    .stop      = callback_stop,
-    .pointer   = callback_pointer,
-    .close     = callback_close,
-    .hw_params = callback_hw_params,
-    .sw_params = callback_sw_params,
-    .prepare   = callback_prepare,
-    .transfer  = callback_transfer,
-};
+static int create_rate_device_map(plugin_data_t* template, snd_config_t* conf)
+{
+    int                   error = 0;
+    snd_config_iterator_t i;
+    snd_config_iterator_t next;
+    snd_config_iterator_t j;
+    snd_config_iterator_t next_device;
+    unsigned int          size  = 0;
 
+    if (conf)
+    {
+        snd_config_for_each(i, next, conf)
+        {
+            size++;
+        }
+    }
+    else
+    {
+        size = ARRAY_SIZE(default_rate_device_map);
+    }
 
-SND_PCM_PLUGIN_DEFINE_FUNC(slimplexor)
+    /* allocating memory for rate->device data structure */
+    template->rate_device_map_size = 0;
+    template->rate_device_map      = calloc(size, sizeof(rate_device_map_t));
+    if (!template->rate_device_map)
+    {
+        error = -ENOMEM;
+        LOG_ERROR("Could not allocate memory for sampling rate mapping (requested %lu bytes)", size * sizeof(rate_device_map_t));
+    }
+
+    if (!error && !conf)
+    {
+        for (unsigned int d = 0; d < size && !error; d++)
+        {
+            rate_device_map_t* entry = &template->rate_device_map[template->rate_device_map_size++];
+
+            entry->rate = default_rate_device_map[d].rate;
+            error       = add_rate_device(entry, default_rate_device_map[d].device);
+        }
+    }
+
+    /* every entry is either a single device name or a list of device names */
+    if (!error && conf)
+    {
+        snd_config_for_each(i, next, conf)
+        {
+            snd_config_t*      n = snd_config_iterator_entry(i);
+            const char*        id;
+            const char*        device;
+            rate_device_map_t* entry;
+
+            if (snd_config_get_id(n, &id) < 0 || !strtoul(id, NULL, 10))
+            {
+                continue;
+            }
+
+            entry       = &template->rate_device_map[template->rate_device_map_size];
+            entry->rate = strtoul(id, NULL, 10);
+            if (snd_config_get_type(n) == SND_CONFIG_TYPE_COMPOUND)
+            {
+                snd_config_for_each(j, next_device, n)
+                {
+                    if (!error && snd_config_get_string(snd_config_iterator_entry(j), &device) >= 0)
+                    {
+                        error = add_rate_device(entry, device);
+                    }
+                }
+            }
+            else if (snd_config_get_string(n, &device) >= 0)
+            {
+                error = add_rate_device(entry, device);
+            }
+
+            /* entry is not counted yet, so strings allocated for it so far are released here */
+            if (error)
+            {
+                free_rate_device(entry);
+                LOG_ERROR("Could not allocate memory for devices of sampling rate %s", id);
+                break;
+            }
+
+            if (entry->device)
+            {
+                LOG_INFO("Sampling rate %u is delivered to %s (secondary devices=%u)", entry->rate, entry->device, entry->secondary_devices_size);
+                template->rate_device_map_size++;
+            }
+            else
+            {
+                LOG_WARNING("Ignoring sampling rate %s as there is no device defined", id);
+            }
+        }
+    }
+
+    return error;
+}
+
+
+/* parses plugin configuration; caller must hold config_lock */
+static int create_config(snd_config_t* conf, char* key, plugin_config_t** configp)
 {
     int                   error          = 0;
-    plugin_data_t*        plugin_data    = NULL;
-    unsigned short        plugin_created = 0;
+    plugin_config_t*      config         = NULL;
+    plugin_data_t*        template       = NULL;
     snd_config_iterator_t i;
     snd_config_iterator_t next;
     const char*           log_level_name;
     const char*           log_file_name;
     int                   log_file_open_error = 0;
+    int                   background_drain    = 0;
+    long                  gapless_window      = 0;
+    int                   track_boundary      = 0;
+    long                  coalesce_latency    = 0;
+    long                  rt_priority         = 0;
+    const char*           rt_cpu_list         = NULL;
+    cpu_set_t             rt_cpus;
+    int                   lock_memory         = 0;
+    const char*           volume_control      = NULL;
+    int                   downmix             = 0;
+    long                  xrun_prefill        = 0;
+    int                   native_width        = 0;
+    int                   metering            = 0;
+    int                   meter_metadata      = 0;
+    snd_config_t*         channel_map         = NULL;
+    snd_config_t*         rate_device_map     = NULL;
+
+    /* key is owned by configuration from now on */
+    config = calloc(1, sizeof(plugin_config_t));
+    if (!config)
+    {
+        free(key);
+        return -ENOMEM;
+    }
+    config->key       = key;
+    config->log_level = default_log_level;
+    template          = &config->template;
 
     snd_config_for_each(i, next, conf)
     {
@@ -222,23 +721,23 @@ SND_PCM_PLUGIN_DEFINE_FUNC(slimplexor)
 
             if (strcasecmp(log_level_name, "none") == 0)
             {
-                log_level = 0;
+                config->log_level = 0;
             }
             else if (strcasecmp(log_level_name, "error") == 0)
             {
-                log_level = 1;
+                config->log_level = 1;
             }
             else if (strcasecmp(log_level_name, "warning") == 0)
             {
-                log_level = 2;
+                config->log_level = 2;
             }
             else if (strcasecmp(log_level_name, "info") == 0)
             {
-                log_level = 3;
+                config->log_level = 3;
             }
             else if (strcasecmp(log_level_name, "debug") == 0)
             {
-                log_level = 4;
+                config->log_level = 4;
             }
 
             continue;
@@ -254,17 +753,17 @@ SND_PCM_PLUGIN_DEFINE_FUNC(slimplexor)
 
             if (strcasecmp(log_file_name, "stdout") == 0)
             {
-                log_file = stdout;
+                config->log_file = stdout;
             }
             else if (strcasecmp(log_file_name, "stderr") == 0)
             {
-                log_file = stderr;
+                config->log_file = stderr;
             }
             else
             {
-                /* log file is never closed, which allows support of multiple calls to ALSA close routine */
-                log_file = fopen(log_file_name, "a");
-                if (!log_file)
+                /* log file is shared by all instances and closed when plugin is unloaded */
+                config->log_file = fopen(log_file_name, "a");
+                if (!config->log_file)
                 {
                     log_file_open_error = errno;
                 }
@@ -281,27 +780,168 @@ SND_PCM_PLUGIN_DEFINE_FUNC(slimplexor)
             }
 
             /* allocated memory here will be released when plugin is unloaded */
-            pcm_dump_file_name = calloc(1, strlen(str) + 1);
-            if (!pcm_dump_file_name)
+            config->pcm_dump_file_name = calloc(1, strlen(str) + 1);
+            if (!config->pcm_dump_file_name)
             {
                 error = -ENOMEM;
                 LOG_ERROR("Could not allocate memory for dump file name (requested %lu bytes)", strlen(str) + 1);
                 break;
             }
-            strcpy(pcm_dump_file_name, str);
+            strcpy(config->pcm_dump_file_name, str);
+        }
+
+        /* setting close mode; if enabled then draining happens in background */
+        if (strcasecmp(id, "background_drain") == 0)
+        {
+            if ((background_drain = snd_config_get_bool(n)) < 0)
+            {
+                background_drain = 0;
+            }
+        }
+
+        /* setting grace window in milliseconds within which reopening with the same parameters continues the stream */
+        if (strcasecmp(id, "gapless_window") == 0)
+        {
+            if (snd_config_get_integer(n, &gapless_window) < 0 || gapless_window < 0)
+            {
+                gapless_window = 0;
+            }
+        }
+
+        /* setting max latency in milliseconds added by coalescing small writes into bigger ones */
+        if (strcasecmp(id, "coalesce_latency") == 0)
+        {
+            if (snd_config_get_integer(n, &coalesce_latency) < 0 || coalesce_latency < 0)
+            {
+                coalesce_latency = 0;
+            }
+        }
+
+        /* setting real-time priority for threads delivering data to the loopback */
+        if (strcasecmp(id, "rt_priority") == 0)
+        {
+            if (snd_config_get_integer(n, &rt_priority) < 0 || rt_priority < 0 || rt_priority > 99)
+            {
+                rt_priority = 0;
+            }
+        }
+
+        /* setting CPUs threads delivering data to the loopback are pinned to */
+        if (strcasecmp(id, "cpu_affinity") == 0)
+        {
+            if (snd_config_get_string(n, &rt_cpu_list) < 0 || parse_cpu_list(rt_cpu_list, &rt_cpus) < 0)
+            {
+                rt_cpu_list = NULL;
+            }
+        }
+
+        /* setting if transfer buffers are locked in memory */
+        if (strcasecmp(id, "lock_memory") == 0)
+        {
+            if ((lock_memory = snd_config_get_bool(n)) < 0)
+            {
+                lock_memory = 0;
+            }
+        }
+
+        /* setting name of shared memory segment used to control volume */
+        if (strcasecmp(id, "volume_control") == 0)
+        {
+            if (snd_config_get_string(n, &volume_control) < 0)
+            {
+                volume_control = NULL;
+            }
+        }
+
+        /* setting if track boundary marker is written when stream is continued */
+        if (strcasecmp(id, "track_boundary_marker") == 0)
+        {
+            if ((track_boundary = snd_config_get_bool(n)) < 0)
+            {
+                track_boundary = 0;
+            }
+        }
+
+        /* setting amount of silence in milliseconds written to the loopback after recovering from xrun */
+        if (strcasecmp(id, "xrun_prefill") == 0)
+        {
+            if (snd_config_get_integer(n, &xrun_prefill) < 0 || xrun_prefill < 0)
+            {
+                xrun_prefill = 0;
+            }
+        }
+
+        /* setting if destination format follows source sample width */
+        if (strcasecmp(id, "native_width") == 0)
+        {
+            if ((native_width = snd_config_get_bool(n)) < 0)
+            {
+                native_width = 0;
+            }
+        }
+
+        /* setting if peak and RMS levels are measured and published through volume control segment */
+        if (strcasecmp(id, "metering") == 0)
+        {
+            if ((metering = snd_config_get_bool(n)) < 0)
+            {
+                metering = 0;
+            }
+        }
+
+        /* setting if levels are encoded into the metadata channel as well */
+        if (strcasecmp(id, "meter_metadata") == 0)
+        {
+            if ((meter_metadata = snd_config_get_bool(n)) < 0)
+            {
+                meter_metadata = 0;
+            }
+        }
+
+        /* setting if multichannel and mono streams are downmixed to stereo */
+        if (strcasecmp(id, "downmix") == 0)
+        {
+            if ((downmix = snd_config_get_bool(n)) < 0)
+            {
+                downmix = 0;
+            }
+        }
+
+        /* setting devices used for each sampling rate; the first device is primary, others get the same stream in non-blocking mode */
+        if (strcasecmp(id, "rate_device_map") == 0)
+        {
+            if (snd_config_get_type(n) == SND_CONFIG_TYPE_COMPOUND)
+            {
+                rate_device_map = n;
+            }
+        }
+
+        /* setting custom downmix matrices; parsed once default matrices are set */
+        if (strcasecmp(id, "channel_map") == 0)
+        {
+            if (snd_config_get_type(n) == SND_CONFIG_TYPE_COMPOUND)
+            {
+                channel_map = n;
+            }
         }
     }
 
     /* making sure log_file is always initialized */
-    if (!log_file)
+    if (!config->log_file)
     {
-        log_file = stdout;
+        config->log_file = stdout;
     }
 
+    /* applying logging settings to the calling thread straight away so configuration is logged to the configured destination */
+    template->log_level          = config->log_level;
+    template->log_file           = config->log_file;
+    template->pcm_dump_file_name = config->pcm_dump_file_name;
+    set_logging(template);
+
     if (!error)
     {
         LOG_INFO("-----------------------------------");
-        LOG_INFO("Loading SlimPlexor v0.1.0 plugin...");
+        LOG_INFO("Loading SlimPlexor v" VERSION_STRING " plugin...");
         if (log_level)
         {
             LOG_INFO("Logging level is %s", log_level_to_string(log_level));
@@ -311,7 +951,7 @@ SND_PCM_PLUGIN_DEFINE_FUNC(slimplexor)
             }
             else
             {
-                LOG_ERROR("Could not open log file defined in configuration, using stdout instead (error=%s, provided file name=%s)", strerror(errno), log_file_name);
+                LOG_ERROR("Could not open log file defined in configuration, using stdout instead (error=%s, provided file name=%s)", strerror(log_file_open_error), log_file_name);
             }
         }
         else
@@ -319,90 +959,235 @@ SND_PCM_PLUGIN_DEFINE_FUNC(slimplexor)
             LOG_INFO("Logging is disabled");
         }
 
-        if (pcm_dump_file_name)
+        if (config->pcm_dump_file_name)
         {
-            LOG_INFO("PCM dump file name is %s", pcm_dump_file_name);
+            LOG_INFO("PCM dump file name is %s", config->pcm_dump_file_name);
         }
         else
         {
             LOG_INFO("PCM dump file is not used");
         }
+
+        LOG_INFO("Background drain is %s", background_drain ? "enabled" : "disabled");
+        if (gapless_window > 0)
+        {
+            LOG_INFO("Gapless window is %ld ms (track boundary marker is %s)", gapless_window, track_boundary ? "enabled" : "disabled");
+        }
+        if (coalesce_latency > 0)
+        {
+            LOG_INFO("Write coalescing latency is %ld ms", coalesce_latency);
+        }
+        if (rt_priority > 0 || rt_cpu_list || lock_memory)
+        {
+            LOG_INFO("Real-time mode is enabled (priority=%ld, CPUs=%s, memory locking is %s)", rt_priority, rt_cpu_list ? rt_cpu_list : "any", lock_memory ? "enabled" : "disabled");
+        }
+        if (volume_control)
+        {
+            LOG_INFO("Volume control is %s", volume_control);
+        }
+        LOG_INFO("Downmix is %s", downmix ? "enabled" : "disabled");
+        LOG_INFO("Silence written after xrun recovery is %ld ms", xrun_prefill);
+        LOG_INFO("Native width output is %s", native_width ? "enabled" : "disabled");
+        LOG_INFO("Metering is %s (metadata encoding is %s)", (metering || meter_metadata) ? "enabled" : "disabled", meter_metadata ? "enabled" : "disabled");
+        if (metering && !meter_metadata && !volume_control)
+        {
+            LOG_WARNING("Levels are only available through tracepoints as metering is enabled without volume_control or meter_metadata");
+        }
     }
 
-    /* allocating memory for plugin data structure and initializing it with zeros */
+    /* initializing plugin data shared by all instances opened with this configuration */
     if (!error)
     {
-        plugin_data = calloc(1, sizeof(plugin_data_t));
-        if (!plugin_data)
+        /* using a fixed format while writing to the target device unless native width is chosen when HW parameters are set */
+        template->dst_format = TARGET_FORMAT;
+
+        template->background_drain      = background_drain;
+        template->gapless_window        = gapless_window;
+        template->track_boundary_marker = track_boundary;
+        template->coalesce_latency      = coalesce_latency;
+        template->rt_priority           = rt_priority;
+        template->rt_cpus_set           = (rt_cpu_list != NULL);
+        template->lock_memory           = lock_memory;
+        template->xrun_prefill          = xrun_prefill;
+        template->native_width          = native_width;
+        template->metering              = (metering || meter_metadata);
+        template->meter_metadata        = meter_metadata;
+        if (rt_cpu_list)
         {
-            error = -ENOMEM;
-            LOG_ERROR("Could not allocate memory for plugin data (requested %lu bytes)", sizeof(plugin_data_t));
+            template->rt_cpus = rt_cpus;
+        }
+
+        /* using default matrices unless they are overridden in configuration */
+        template->downmix = downmix;
+        init_channel_matrices(template);
+        if (channel_map)
+        {
+            snd_config_for_each(i, next, channel_map)
+            {
+                snd_config_t* n = snd_config_iterator_entry(i);
+                const char*   id;
+                const char*   coefficients;
+                long          channels;
+
+                if (snd_config_get_id(n, &id) < 0 || snd_config_get_string(n, &coefficients) < 0)
+                {
+                    continue;
+                }
+
+                channels = strtol(id, NULL, 10);
+                if (set_channel_matrix(template, channels, coefficients) < 0)
+                {
+                    LOG_WARNING("Ignoring invalid channel map for %s channels (coefficients=%s)", id, coefficients);
+                }
+            }
+        }
+
+        /* volume control is optional, so plugin works with unity gain if it could not be opened; mapping is shared by all instances */
+        template->gain_current = CONTROL_GAIN_UNITY;
+        template->gain_target  = CONTROL_GAIN_UNITY;
+        template->gain_step    = 1;
+        if (volume_control)
+        {
+            template->control = open_control(volume_control);
         }
     }
 
-    /* initializing plugin data structure */
+    /* building rate->device map either from configuration or from defaults */
     if (!error)
     {
-        plugin_data->alsa_data.version      = SND_PCM_IOPLUG_VERSION;
-        plugin_data->alsa_data.name         = "SlimPlexor - An ALSA plugin used by SlimStreamer";
-        plugin_data->alsa_data.callback     = &callbacks;
-        plugin_data->alsa_data.private_data = plugin_data;
+        error = create_rate_device_map(template, rate_device_map);
+    }
+    if (!error && !template->rate_device_map_size)
+    {
+        error = -EINVAL;
+        LOG_ERROR("There is no sampling rate with a device defined in rate_device_map");
+    }
+
+    if (error)
+    {
+        destroy_config(config);
+        config = NULL;
+    }
+    *configp = config;
 
-        /* useing a fixed format while writing to the target device */
-        plugin_data->dst_format = TARGET_FORMAT;
+    return error;
+}
 
-        /* TODO: should come from config */
-        plugin_data->rate_device_map_size = 13;
 
-        /* allocating memory for rate->device data structure */
-        plugin_data->rate_device_map = calloc(plugin_data->rate_device_map_size, sizeof(rate_device_map_t));
-        if (!plugin_data->rate_device_map)
+/* looking up already parsed configuration so opening the plugin does not parse it again; caller must hold config_lock */
+static int get_config(snd_config_t* conf, plugin_config_t** configp)
+{
+    int              error  = 0;
+    plugin_config_t* config = NULL;
+    snd_output_t*    output = NULL;
+    char*            buffer = NULL;
+    size_t           size   = 0;
+    char*            key    = NULL;
+
+    /* configuration node is recreated by ALSA for every open, so its content is used as a key */
+    if ((error = snd_output_buffer_open(&output)) < 0)
+    {
+        return error;
+    }
+    if ((error = snd_config_save(conf, output)) >= 0)
+    {
+        /* buffer is not NUL terminated */
+        size  = snd_output_buffer_string(output, &buffer);
+        key   = strndup(buffer, size);
+        error = (key ? 0 : -ENOMEM);
+    }
+    snd_output_close(output);
+    if (error < 0)
+    {
+        return error;
+    }
+
+    for (config = configs; config && strcmp(config->key, key); config = config->next);
+
+    if (config)
+    {
+        free(key);
+    }
+    else if (!(error = create_config(conf, key, &config)))
+    {
+        config->next = configs;
+        configs      = config;
+    }
+    *configp = config;
+
+    return error;
+}
+
+
+/* making sure background drains are complete and shared configuration is released before the plugin is unloaded */
+static void __attribute__((destructor)) plugin_unload()
+{
+    wait_for_background_drains();
+
+    pthread_mutex_lock(&config_lock);
+    log_level = 0;
+    while (configs)
+    {
+        plugin_config_t* config = configs;
+        configs = config->next;
+        destroy_config(config);
+    }
+    pthread_mutex_unlock(&config_lock);
+}
+
+
+SND_PCM_PLUGIN_DEFINE_FUNC(slimplexor)
+{
+    int              error          = 0;
+    plugin_data_t*   plugin_data    = NULL;
+    unsigned short   plugin_created = 0;
+    plugin_config_t* config         = NULL;
+
+    /* configuration is parsed once per process, later opens reuse it */
+    pthread_mutex_lock(&config_lock);
+    if (!(error = get_config(conf, &config)))
+    {
+        set_logging(&config->template);
+    }
+    pthread_mutex_unlock(&config_lock);
+
+    if (error)
+    {
+        return error;
+    }
+
+    /* allocating memory for plugin data structure */
+    if (!error)
+    {
+        plugin_data = malloc(sizeof(plugin_data_t));
+        if (!plugin_data)
         {
             error = -ENOMEM;
-            LOG_ERROR("Could not allocate memory for sampling rate mapping (requested %lu bytes)", sizeof(rate_device_map_t));
+            LOG_ERROR("Could not allocate memory for plugin data (requested %lu bytes)", sizeof(plugin_data_t));
         }
     }
 
-    /* TODO: should come from config */
-    /* initializing rate->device map data structure */
-    if (!error)
-    {
-        plugin_data->rate_device_map[0].rate    = 8000;
-        plugin_data->rate_device_map[0].device  = "hw:1,0,1";
-        plugin_data->rate_device_map[1].rate    = 11025;
-        plugin_data->rate_device_map[1].device  = "hw:1,0,2";
-        plugin_data->rate_device_map[2].rate    = 12000;
-        plugin_data->rate_device_map[2].device  = "hw:1,0,3";
-        plugin_data->rate_device_map[3].rate    = 16000;
-        plugin_data->rate_device_map[3].device  = "hw:1,0,4";
-        plugin_data->rate_device_map[4].rate    = 22500;
-        plugin_data->rate_device_map[4].device  = "hw:1,0,5";
-        plugin_data->rate_device_map[5].rate    = 24000;
-        plugin_data->rate_device_map[5].device  = "hw:1,0,6";
-        plugin_data->rate_device_map[6].rate    = 32000;
-        plugin_data->rate_device_map[6].device  = "hw:1,0,7";
-        plugin_data->rate_device_map[7].rate    = 44100;
-        plugin_data->rate_device_map[7].device  = "hw:2,0,1";
-        plugin_data->rate_device_map[8].rate    = 48000;
-        plugin_data->rate_device_map[8].device  = "hw:2,0,2";
-        plugin_data->rate_device_map[9].rate    = 88200;
-        plugin_data->rate_device_map[9].device  = "hw:2,0,3";
-        plugin_data->rate_device_map[10].rate   = 96000;
-        plugin_data->rate_device_map[10].device = "hw:2,0,4";
-        plugin_data->rate_device_map[11].rate   = 176400;
-        plugin_data->rate_device_map[11].device = "hw:2,0,5";
-        plugin_data->rate_device_map[12].rate   = 192000;
-        plugin_data->rate_device_map[12].device = "hw:2,0,6";
-    }
-
-    /* this hack is required to avoid ALSA mutex deadlocks; ALSA does not expose this functionality via API */
+    /* initializing plugin data structure with configured settings */
     if (!error)
     {
-        /* TODO: should come from config */
-        if (setenv("LIBASOUND_THREAD_SAFE", "0", 1) < 0)
+        *plugin_data = config->template;
+
+        plugin_data->alsa_data.version      = SND_PCM_IOPLUG_VERSION;
+        plugin_data->alsa_data.name         = "SlimPlexor - An ALSA plugin used by SlimStreamer";
+        plugin_data->alsa_data.callback     = &callbacks;
+        plugin_data->alsa_data.private_data = plugin_data;
+        plugin_data->meter_writer_id        = ((uint64_t)getpid() << 32) | __atomic_add_fetch(&instances, 1, __ATOMIC_RELAXED);
+
+        /* callbacks are serialized per instance, so ALSA library locking can stay enabled for the whole process */
+        pthread_mutex_init(&plugin_data->lock, NULL);
+        pthread_cond_init(&plugin_data->io_done, NULL);
+        plugin_data->io_busy = 0;
+
+        /* starting with the current volume straight away instead of ramping to it */
+        if (plugin_data->control)
         {
-            error = -EPERM;
-            LOG_ERROR("Could not disable thread-safety for ALSA library");
+            update_gain(plugin_data);
+            plugin_data->gain_current = plugin_data->gain_target;
         }
     }
 
@@ -429,19 +1214,21 @@ SND_PCM_PLUGIN_DEFINE_FUNC(slimplexor)
     {
         /* this assignment must occur only in case when everything went fine */
         *pcmp = plugin_data->alsa_data.pcm;
+        start_coalesce_thread(plugin_data);
         LOG_INFO("Plugin was loaded");
     }
-    else
+    else if (plugin_data)
     {
-        /* plugin was not created properly */
-        if (!plugin_data && plugin_created)
+        /* plugin was not created properly; deleting the plugin invokes close callback which releases plugin data */
+        if (plugin_created)
         {
             snd_pcm_ioplug_delete(&plugin_data->alsa_data);
         }
-        if (plugin_data->rate_device_map)
+        else
         {
-            free(plugin_data->rate_device_map);
-            plugin_data->rate_device_map = NULL;
+            pthread_cond_destroy(&plugin_data->io_done);
+            pthread_mutex_destroy(&plugin_data->lock);
+            free(plugin_data);
         }
     }
 
@@ -18,15 +18,18 @@
 
 #include <alsa/asoundlib.h>
 #include <alsa/pcm_external.h>
+#include <pthread.h>
+#include <sched.h>   /* cpu_set_t */
 #include <stddef.h>  /* size_t */
 #include <stdio.h>
+#include "control.h"
+#include "probes.h"
 
 
 /* defined in slimplexor.c */
-extern unsigned int log_level;
-extern FILE*        log_file;
-extern FILE*        pcm_dump_file;
-extern char*        pcm_dump_file_name;
+/* logging settings of the plugin instance the calling thread works for (see set_logging) */
+extern __thread unsigned int log_level;
+extern __thread FILE*        log_file;
 
 #define LOG_DEBUG(fmt, arg...)     if (log_level >= 4) fprintf(log_file, "D, %s, " fmt "\n", __FUNCTION__ , ## arg)
 #define LOG_INFO(fmt, arg...)      if (log_level >= 3) fprintf(log_file, "I, %s, " fmt "\n", __FUNCTION__ , ## arg)
@@ -34,24 +37,98 @@ extern char*        pcm_dump_file_name;
 #define LOG_ERROR(fmt, arg...)     if (log_level >= 1) fprintf(log_file, "E, %s, " fmt "\n", __FUNCTION__ , ## arg)
 
 #define ARRAY_SIZE(a)              (sizeof(a)/sizeof((a)[0]))
+#define STRINGIFY(x)               #x
+#define TO_STRING(x)               STRINGIFY(x)
+#define VERSION_MAJOR              0
+#define VERSION_MINOR              1
+#define VERSION_PATCH              0
+#define VERSION_STRING             TO_STRING(VERSION_MAJOR) "." TO_STRING(VERSION_MINOR) "." TO_STRING(VERSION_PATCH)
+#define CACHE_LINE_SIZE            64
+#define GAIN_RAMP_MS               10     /* volume changes are ramped over 10 ms to avoid clicks */
+#define CONTROL_INIT_TIMEOUT_MS    100    /* how long an opener of volume control waits for the creator to initialize it */
+#define METER_WINDOW_MS            50     /* peak and RMS are measured over 50 ms windows */
+#define OUTPUT_CHANNELS            2      /* amount of PCM channels delivered to the loopback when downmixing */
+#define MAX_SOURCE_CHANNELS        8
+#define MIX_BLOCK_SIZE             256    /* frames converted at once before downmixing */
+#define MATRIX_UNITY               16384  /* channel matrix coefficients are Q14 fixed point values */
 #define TARGET_FORMAT              SND_PCM_FORMAT_S32_LE
+#define NATIVE_WIDTH_FORMAT        SND_PCM_FORMAT_S16_LE  /* used instead of TARGET_FORMAT for 8 and 16 bits sources if native_width is enabled */
 #define PERIOD_SIZE_BYTES          16384  /* one period size = 16K bytes */
 #define PERIODS                    8      /* buffer size 16K * 8 = 128K bytes */
+/* marker is stored in the last byte of every destination frame, which is the most significant byte of the metadata channel */
 #define BEGINNING_OF_STREAM_MARKER 1
 #define END_OF_STREAM_MARKER       2
 #define DATA_MARKER                3
+#define TRACK_BOUNDARY_MARKER      4
+#define XRUN_MARKER                5      /* silence inserted while recovering from loopback xrun */
+#define SILENCE_MARKER             6      /* silence keeping a parked stream running until it is continued or finished */
+#define XRUN_RECOVERY_ATTEMPTS     3      /* bounds time spent in a single write when loopback keeps failing */
+#define PCM_DUMP_INFO_SUFFIX       ".info"
+#define MAX_SECONDARY_DEVICES      3      /* destinations receiving the same stream in addition to the primary one */
+/* stream descriptor is carried by the first frames of beginning of stream period, one byte per frame in the least significant byte of the metadata channel */
+#define DESCRIPTOR_VERSION         1
+#define DESCRIPTOR_SIZE            16
+#define DESCRIPTOR_NATIVE_WIDTH    0x01   /* descriptor flags */
+#define DESCRIPTOR_DOWNMIX         0x02
+#define DESCRIPTOR_METER_METADATA  0x04
 
 
 typedef struct rate_device_map
 {
     unsigned int rate;
     char*        device;
+    char*        secondary_devices[MAX_SECONDARY_DEVICES];
+    unsigned int secondary_devices_size;
 } rate_device_map_t;
 
 
+/* destination written in non-blocking mode from its own backlog, so it can not stall the primary destination */
+typedef struct secondary_destination
+{
+    char*             device;
+    snd_pcm_t*        pcm_handle;
+    unsigned char*    backlog;               /* frames accepted by the primary destination but not yet by this one */
+    size_t            backlog_bytes;
+    snd_pcm_uframes_t backlog_size;
+    snd_pcm_uframes_t backlog_current;
+    unsigned long     dropped_frames;        /* frames lost because backlog was full */
+} secondary_destination_t;
+
+
+/* decoded stream descriptor; see encode_stream_descriptor for the wire layout */
+typedef struct stream_descriptor
+{
+    unsigned int     version;
+    snd_pcm_format_t format;                 /* original format provided by application */
+    unsigned int     bits;                   /* significant bits of the original format */
+    unsigned int     channels;               /* original amount of channels */
+    unsigned int     dst_channels;           /* PCM channels in the loopback, excluding metadata channel */
+    unsigned int     rate;
+    unsigned int     flags;
+    unsigned int     plugin_version[3];      /* major, minor, patch */
+} stream_descriptor_t;
+
+
+typedef struct channel_matrix
+{
+    unsigned int channels;
+    int          coefficients[OUTPUT_CHANNELS][MAX_SOURCE_CHANNELS];
+} channel_matrix_t;
+
+
+/* called with frames converted by transfer_frames before they are written */
+typedef void (*converted_callback_t)(void* context, unsigned char* frames, size_t size);
+
+
 typedef struct plugin_data
 {
     snd_pcm_ioplug_t   alsa_data;
+    pthread_mutex_t    lock;                     /* never held across blocking I/O (see io_busy) */
+    pthread_cond_t     io_done;
+    unsigned short     io_busy;                  /* a callback does blocking I/O on the destination without holding the lock */
+    unsigned int       log_level;
+    FILE*              log_file;
+    const char*        pcm_dump_file_name;
     unsigned int       rate_device_map_size;
     rate_device_map_t* rate_device_map;
     snd_pcm_sframes_t  pointer;
@@ -63,22 +140,104 @@ typedef struct plugin_data
     snd_pcm_uframes_t  dst_period_size;
     unsigned int       dst_periods;
     unsigned char*     dst_buffer;
+    size_t             dst_buffer_bytes;
     snd_pcm_uframes_t  dst_buffer_size;
     snd_pcm_uframes_t  dst_buffer_current;
     unsigned short     transfer_started;
+    unsigned short     background_drain;
+    unsigned int       gapless_window;
+    unsigned short     track_boundary_marker;
+    unsigned short     stream_continued;
+    FILE*              pcm_dump_file;
+    FILE*              pcm_dump_info_file;
+    unsigned int       coalesce_latency;         /* max milliseconds frames may wait in the transfer buffer; 0 disables coalescing */
+    snd_pcm_uframes_t  coalesce_watermark;
+    snd_pcm_uframes_t  coalesce_chunk_average;
+    unsigned long long coalesce_started_at;
+    pthread_t          coalesce_thread;          /* writes coalesced frames once their deadline passes while application is idle */
+    unsigned short     coalesce_thread_running;
+    unsigned short     coalesce_thread_stop;
+    unsigned int       rt_priority;              /* SCHED_FIFO priority for delivery threads; 0 keeps default scheduling */
+    cpu_set_t          rt_cpus;
+    unsigned short     rt_cpus_set;
+    unsigned short     lock_memory;
+    pid_t              rt_thread;                /* kernel id of the thread real-time settings were applied to */
+    unsigned short     rt_thread_set;
+    int                rt_saved_policy;          /* settings the thread had before, restored on close */
+    struct sched_param rt_saved_param;
+    cpu_set_t          rt_saved_cpus;
+    control_t*         control;
+    int                gain_current;
+    int                gain_target;
+    int                gain_step;
+    unsigned short     downmix;
+    unsigned short     native_width;             /* destination format follows source width instead of being always TARGET_FORMAT */
+    channel_matrix_t   channel_matrices[3];      /* mono, 5.1 and 7.1 to stereo */
+    channel_matrix_t*  channel_matrix;           /* matrix used for the current stream; NULL if channels are passed as they are */
+    unsigned int       xrun_prefill;             /* milliseconds of silence written to the loopback after xrun recovery */
+    unsigned char*     xrun_buffer;              /* silence frames marked with XRUN marker */
+    size_t             xrun_buffer_bytes;
+    snd_pcm_uframes_t  xrun_buffer_size;
+    unsigned long      xrun_count;
+    unsigned long long xrun_recovery_time;       /* total microseconds spent recovering */
+    unsigned long long xrun_recovery_time_max;
+    unsigned long      write_errors;             /* failed writes to the destination device while transferring */
+    secondary_destination_t secondaries[MAX_SECONDARY_DEVICES];
+    unsigned int       secondaries_size;
+    unsigned short     metering;                 /* peak and RMS are measured while converting */
+    unsigned short     meter_metadata;           /* levels are encoded into spare bytes of the metadata channel */
+    snd_pcm_uframes_t  meter_window;             /* frames per metering window */
+    snd_pcm_uframes_t  meter_frames;             /* frames measured in the current window */
+    uint32_t           meter_peak[MAX_SOURCE_CHANNELS];
+    uint64_t           meter_sum[MAX_SOURCE_CHANNELS];
+    uint32_t           meter_last_peak[MAX_SOURCE_CHANNELS];
+    uint32_t           meter_last_rms[MAX_SOURCE_CHANNELS];
+    unsigned int       meter_channel;            /* channel encoded into the next frame's metadata */
+    uint64_t           meter_writer_id;          /* identifies this instance as the only meter writer of volume control segment */
 } plugin_data_t;
 
 
+unsigned char*    allocate_buffer(plugin_data_t* plugin_data, size_t size_in_bytes);
+void              free_buffer(plugin_data_t* plugin_data, unsigned char* buffer, size_t size_in_bytes);
+control_t*        open_control(const char* name);
 int               open_destination_device(plugin_data_t* plugin_data);
+void              open_secondary_destinations(plugin_data_t* plugin_data);
+FILE*             open_pcm_dump_info_file(const char* pcm_dump_file_name);
+int               parse_cpu_list(const char* cpu_list, cpu_set_t* cpus);
+void              publish_meters(plugin_data_t* plugin_data);
+int               reclaim_destination_device(plugin_data_t* plugin_data);
+int               recover_destination_device(plugin_data_t* plugin_data, int error);
+void              release_meters(plugin_data_t* plugin_data);
+int               set_channel_matrix(plugin_data_t* plugin_data, unsigned int channels, const char* coefficients);
+int               claim_meters(plugin_data_t* plugin_data);
+void              close_control(control_t* control);
 void              close_destination_device(plugin_data_t* plugin_data);
-void              copy_frames(plugin_data_t* plugin_data, unsigned char* pcm_data, snd_pcm_uframes_t frames);
-void              copy_sample(plugin_data_t* plugin_data, unsigned char* source_sample, size_t source_sample_size, unsigned char* target_sample);
+void              close_secondary_destinations(plugin_data_t* plugin_data);
+void              copy_frames(plugin_data_t* plugin_data, const snd_pcm_channel_area_t* areas, snd_pcm_uframes_t offset, snd_pcm_uframes_t frames);
+void              drain_destination_device(plugin_data_t* plugin_data);
+void              drain_secondary_destinations(plugin_data_t* plugin_data);
+int               decode_stream_descriptor(const unsigned char* descriptor, stream_descriptor_t* stream_descriptor);
+void              encode_stream_descriptor(plugin_data_t* plugin_data, unsigned char* descriptor);
+void              init_channel_matrices(plugin_data_t* plugin_data);
+int               drain_destination_device_in_background(plugin_data_t* plugin_data, unsigned int grace_period);
+void              get_deadline(struct timespec* deadline, unsigned int milliseconds);
+unsigned long long get_time_us();
+int               is_write_due(plugin_data_t* plugin_data);
 const char*       log_level_to_string();
 int               set_src_hw_params(snd_pcm_ioplug_t *io);
 int               set_dst_hw_params(plugin_data_t* plugin_data, snd_pcm_hw_params_t *params);
 int               set_dst_sw_params(plugin_data_t* plugin_data, snd_pcm_sw_params_t *params);
+void              set_logging(plugin_data_t* plugin_data);
+void              set_realtime_scheduling(plugin_data_t* plugin_data);
+void              restore_realtime_scheduling(plugin_data_t* plugin_data);
+snd_pcm_uframes_t transfer_frames(plugin_data_t* plugin_data, const snd_pcm_channel_area_t* areas, snd_pcm_uframes_t offset, snd_pcm_uframes_t frames_provided, int consume_all, converted_callback_t converted_callback, void* context);
+void              update_coalesce_watermark(plugin_data_t* plugin_data, snd_pcm_uframes_t frames_provided);
+void              update_gain(plugin_data_t* plugin_data);
+void              wait_for_background_drains();
 void              write_stream_marker(plugin_data_t* plugin_data, unsigned char marker);
 snd_pcm_sframes_t write_to_dst(plugin_data_t* plugin_data);
+void              write_to_pcm_dump_file(plugin_data_t* plugin_data, unsigned char* buffer, snd_pcm_uframes_t frames);
+void              write_to_secondary_destinations(plugin_data_t* plugin_data, unsigned char* buffer, snd_pcm_uframes_t frames);
 
 
 #endif  /* SLIMPLEXOR_H */
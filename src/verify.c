@@ -0,0 +1,571 @@
+/*
+ * Copyright 2017, Andrej Kislovskij
+ *
+ * This is PUBLIC DOMAIN software so use at your own risk as it comes
+ * with no warranties. This code is yours to share, use and modify without
+ * any restrictions or obligations.
+ *
+ * For more information see conwrap/LICENSE or refer refer to http://unlicense.org
+ *
+ * Author: gimesketvirtadieni at gmail dot com (Andrej Kislovskij)
+ */
+
+/*
+ * slimplexor-verify reads what SlimPlexor delivers to the loopback, either from the capture side of a loopback device
+ * (for example hw:2,1,1 for data written to hw:2,0,1) or from a file (PCM dump, FIFO or '-' for stdin), and checks
+ * stream framing by following the marker written in the last byte of every frame:
+ *
+ *   - data and track boundary frames are only accepted between beginning and end of stream
+ *   - every stream starts with a valid descriptor which matches capture parameters
+ *   - marker frames do not contain PCM data and there are no unknown markers
+ *
+ * Checks start with the first beginning or end of stream block, so verification can be started at any time.
+ * Silence (zero marker) inside a stream is reported as a gap, XRUN marker blocks as xrun signatures.
+ * Silence marked by the plugin while a stream is parked is counted, but it is neither a gap nor a violation.
+ * Throughput, marker latency (capture only) and the counters are reported at the end and optionally every interval.
+ * Exit code is 2 if framing violations were found and, with -x, 3 if there were gaps or xrun signatures, so the tool can be used
+ * as a soak test or a health probe.
+ */
+
+#include <getopt.h>
+#include <signal.h>
+#include "slimplexor.h"
+
+
+/* verifier uses its own logging settings */
+__thread unsigned int log_level = 2;
+__thread FILE*        log_file  = NULL;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+
+typedef struct verify_stats
+{
+    unsigned long long frames;
+    unsigned long long data_frames;
+    unsigned long long streams;
+    unsigned long long track_boundaries;
+    unsigned long long gaps;
+    unsigned long long gap_frames;
+    unsigned long long xruns;
+    unsigned long long xrun_frames;
+    unsigned long long parked_frames;
+    unsigned long long capture_overruns;
+    unsigned long long violations;
+    unsigned long long marker_latency_sum;  /* us */
+    unsigned long long marker_latency_max;  /* us */
+    unsigned long long marker_latencies;
+    unsigned int       last_marker;
+    unsigned int       synchronized;        /* stream state is known once beginning or end of stream is seen */
+    unsigned int       in_stream;
+    unsigned int       descriptor_size;     /* descriptor bytes collected from the current beginning of stream block */
+    unsigned char      descriptor[DESCRIPTOR_SIZE];
+} verify_stats_t;
+
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [options] <capture device | file>\n", name);
+    fprintf(stderr, "  -F            read from a file (PCM dump, FIFO or '-' for stdin) instead of a capture device\n");
+    fprintf(stderr, "  -f <format>   loopback format, S32_LE or S16_LE (default: S32_LE)\n");
+    fprintf(stderr, "  -c <channels> PCM channels in the loopback, metadata channel excluded (default: 2)\n");
+    fprintf(stderr, "  -s <rate>     sampling rate (default: 44100)\n");
+    fprintf(stderr, "  -p <frames>   capture period size (default: 2048)\n");
+    fprintf(stderr, "  -t <seconds>  stop after given amount of seconds (default: run until end of input or SIGINT)\n");
+    fprintf(stderr, "  -i <seconds>  report every given amount of seconds (default: 0, report only at the end)\n");
+    fprintf(stderr, "  -x            fail with exit code 3 if gaps or xrun signatures were found\n");
+    fprintf(stderr, "  -v            log every stream event\n");
+}
+
+
+static void on_signal(int signal_number)
+{
+    stop_requested = 1;
+}
+
+
+static int open_capture_device(const char* device, snd_pcm_format_t format, unsigned int channels, unsigned int rate, snd_pcm_uframes_t period_size, snd_pcm_t** pcm_handle)
+{
+    int                  error     = 0;
+    snd_pcm_hw_params_t* hw_params = NULL;
+
+    if ((error = snd_pcm_open(pcm_handle, device, SND_PCM_STREAM_CAPTURE, 0)) < 0)
+    {
+        LOG_ERROR("Could not open capture device %s: %s", device, snd_strerror(error));
+    }
+    if (!error)
+    {
+        if ((error = snd_pcm_hw_params_malloc(&hw_params)) < 0)
+        {
+            LOG_ERROR("Could not allocate HW parameters: %s", snd_strerror(error));
+        }
+    }
+    if (!error)
+    {
+        if ((error = snd_pcm_hw_params_any(*pcm_handle, hw_params)) < 0)
+        {
+            LOG_ERROR("Could not fill HW parameters with defaults: %s", snd_strerror(error));
+        }
+    }
+    if (!error)
+    {
+        if ((error = snd_pcm_hw_params_set_access(*pcm_handle, hw_params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0)
+        {
+            LOG_ERROR("Could not set capture device access mode: %s", snd_strerror(error));
+        }
+    }
+    if (!error)
+    {
+        if ((error = snd_pcm_hw_params_set_format(*pcm_handle, hw_params, format)) < 0)
+        {
+            LOG_ERROR("Could not set capture device format: %s", snd_strerror(error));
+        }
+    }
+    if (!error)
+    {
+        /* metadata channel is captured as well */
+        if ((error = snd_pcm_hw_params_set_channels(*pcm_handle, hw_params, channels + 1)) < 0)
+        {
+            LOG_ERROR("Could not set amount of channels for capture device: %s", snd_strerror(error));
+        }
+    }
+    if (!error)
+    {
+        if ((error = snd_pcm_hw_params_set_rate(*pcm_handle, hw_params, rate, 0)) < 0)
+        {
+            LOG_ERROR("Could not set sample rate for capture device: %s", snd_strerror(error));
+        }
+    }
+    if (!error)
+    {
+        if ((error = snd_pcm_hw_params_set_period_size(*pcm_handle, hw_params, period_size, 0)) < 0)
+        {
+            LOG_ERROR("Could not set period size for capture device: %s", snd_strerror(error));
+        }
+    }
+    if (!error)
+    {
+        if ((error = snd_pcm_hw_params_set_periods(*pcm_handle, hw_params, PERIODS, 0)) < 0)
+        {
+            LOG_ERROR("Could not set amount of periods for capture device: %s", snd_strerror(error));
+        }
+    }
+    if (!error)
+    {
+        if ((error = snd_pcm_hw_params(*pcm_handle, hw_params)) < 0)
+        {
+            LOG_ERROR("Could set hardware parameters: %s", snd_strerror(error));
+        }
+    }
+    if (hw_params)
+    {
+        snd_pcm_hw_params_free(hw_params);
+    }
+
+    if (error && *pcm_handle)
+    {
+        snd_pcm_close(*pcm_handle);
+        *pcm_handle = NULL;
+    }
+
+    return error;
+}
+
+
+static void report_violation(verify_stats_t* stats, const char* description)
+{
+    stats->violations++;
+    LOG_ERROR("Framing violation at frame %llu: %s", stats->frames, description);
+}
+
+
+/* checking descriptor collected from beginning of stream block against capture parameters */
+static void check_descriptor(verify_stats_t* stats, snd_pcm_format_t format, unsigned int channels, unsigned int rate)
+{
+    stream_descriptor_t descriptor;
+    int                 empty = 1;
+
+    for (unsigned int i = 0; i < DESCRIPTOR_SIZE; i++)
+    {
+        empty = (empty && !stats->descriptor[i]);
+    }
+
+    if (empty)
+    {
+        report_violation(stats, "beginning of stream does not contain descriptor");
+    }
+    else if (decode_stream_descriptor(stats->descriptor, &descriptor) < 0)
+    {
+        report_violation(stats, "stream descriptor is corrupted");
+    }
+    else
+    {
+        LOG_INFO("Stream started (format=%s, bits=%u, channels=%u, rate=%u, loopback channels=%u, flags=0x%02x, plugin version=%u.%u.%u)",
+            snd_pcm_format_name(descriptor.format),
+            descriptor.bits,
+            descriptor.channels,
+            descriptor.rate,
+            descriptor.dst_channels,
+            descriptor.flags,
+            descriptor.plugin_version[0],
+            descriptor.plugin_version[1],
+            descriptor.plugin_version[2]);
+
+        if (descriptor.rate != rate || descriptor.dst_channels != channels || !(descriptor.flags & DESCRIPTOR_NATIVE_WIDTH) != (format == TARGET_FORMAT))
+        {
+            report_violation(stats, "stream descriptor does not match capture parameters");
+        }
+    }
+}
+
+
+static void check_frame(verify_stats_t* stats, unsigned char* frame, size_t sample_size, snd_pcm_format_t format, unsigned int channels, unsigned int rate)
+{
+    size_t       frame_size = sample_size * (channels + 1);
+    unsigned int marker     = frame[frame_size - 1];
+    int          run_start  = (marker != stats->last_marker);
+    int          silent     = 1;
+
+    for (size_t i = 0; i < sample_size * channels; i++)
+    {
+        silent = (silent && !frame[i]);
+    }
+
+    /* verification may start in the middle of a stream, so framing is not checked until it is synchronized */
+    if (!stats->synchronized && marker != BEGINNING_OF_STREAM_MARKER && marker != END_OF_STREAM_MARKER && marker <= SILENCE_MARKER)
+    {
+        stats->last_marker = marker;
+        stats->frames++;
+        return;
+    }
+    if (!stats->synchronized && marker == END_OF_STREAM_MARKER)
+    {
+        stats->in_stream       = 1;
+        stats->descriptor_size = DESCRIPTOR_SIZE;
+    }
+    stats->synchronized = 1;
+
+    switch (marker)
+    {
+        case 0:
+            /* loopback provides silence if nothing was written; inside a stream it means the consumer missed data */
+            if (stats->in_stream)
+            {
+                stats->gaps += run_start;
+                stats->gap_frames++;
+                if (run_start)
+                {
+                    LOG_WARNING("Gap in the stream at frame %llu", stats->frames);
+                }
+            }
+            break;
+
+        case BEGINNING_OF_STREAM_MARKER:
+            if (run_start)
+            {
+                if (stats->in_stream)
+                {
+                    report_violation(stats, "beginning of stream without end of previous stream");
+                }
+                stats->in_stream       = 1;
+                stats->descriptor_size = 0;
+                stats->streams++;
+            }
+            if (stats->descriptor_size < DESCRIPTOR_SIZE)
+            {
+                stats->descriptor[stats->descriptor_size++] = frame[frame_size - sample_size];
+                if (stats->descriptor_size == DESCRIPTOR_SIZE)
+                {
+                    check_descriptor(stats, format, channels, rate);
+                }
+            }
+            break;
+
+        case END_OF_STREAM_MARKER:
+            if (run_start)
+            {
+                if (!stats->in_stream)
+                {
+                    report_violation(stats, "end of stream without beginning of stream");
+                }
+                else if (stats->descriptor_size < DESCRIPTOR_SIZE)
+                {
+                    report_violation(stats, "beginning of stream block is shorter than descriptor");
+                }
+                stats->in_stream = 0;
+                LOG_INFO("Stream ended at frame %llu", stats->frames);
+            }
+            break;
+
+        case DATA_MARKER:
+            if (!stats->in_stream)
+            {
+                report_violation(stats, "data frame outside of stream");
+            }
+            stats->data_frames++;
+            break;
+
+        case TRACK_BOUNDARY_MARKER:
+            if (!stats->in_stream)
+            {
+                report_violation(stats, "track boundary outside of stream");
+            }
+            stats->track_boundaries++;
+            LOG_INFO("Track boundary at frame %llu", stats->frames);
+            break;
+
+        case XRUN_MARKER:
+            if (!stats->in_stream)
+            {
+                report_violation(stats, "xrun silence outside of stream");
+            }
+            stats->xruns += run_start;
+            stats->xrun_frames++;
+            if (run_start)
+            {
+                LOG_WARNING("Xrun signature at frame %llu", stats->frames);
+            }
+            break;
+
+        case SILENCE_MARKER:
+            if (!stats->in_stream)
+            {
+                report_violation(stats, "parked stream silence outside of stream");
+            }
+            stats->parked_frames++;
+            break;
+
+        default:
+            report_violation(stats, "unknown marker, stream is not aligned to frames or contains junk");
+            break;
+    }
+
+    /* marker frames are zeroed by the plugin, so PCM data in them means the stream is corrupted */
+    if (marker != DATA_MARKER && !silent)
+    {
+        report_violation(stats, "marker frame contains PCM data");
+    }
+
+    stats->last_marker = marker;
+    stats->frames++;
+}
+
+
+static void print_report(verify_stats_t* stats, unsigned int rate, unsigned long long elapsed, unsigned long long interval_frames, unsigned long long interval)
+{
+    fprintf(stdout, "frames:            %llu\n", stats->frames);
+    fprintf(stdout, "data frames:       %llu\n", stats->data_frames);
+    fprintf(stdout, "streams:           %llu\n", stats->streams);
+    fprintf(stdout, "track boundaries:  %llu\n", stats->track_boundaries);
+    fprintf(stdout, "gaps:              %llu (%llu frames)\n", stats->gaps, stats->gap_frames);
+    fprintf(stdout, "xruns:             %llu (%llu frames)\n", stats->xruns, stats->xrun_frames);
+    fprintf(stdout, "parked silence:    %llu frames\n", stats->parked_frames);
+    fprintf(stdout, "capture overruns:  %llu\n", stats->capture_overruns);
+    fprintf(stdout, "violations:        %llu\n", stats->violations);
+    fprintf(stdout, "elapsed:           %.3f s\n", elapsed / 1000000.0);
+    if (elapsed)
+    {
+        fprintf(stdout, "throughput:        %.0f frames/s (%.2f of real-time)\n", stats->frames * 1000000.0 / elapsed, stats->frames * 1000000.0 / elapsed / rate);
+    }
+    if (interval)
+    {
+        fprintf(stdout, "interval:          %.0f frames/s\n", interval_frames * 1000000.0 / interval);
+    }
+    if (stats->marker_latencies)
+    {
+        fprintf(stdout, "marker latency:    avg %llu us, max %llu us\n", stats->marker_latency_sum / stats->marker_latencies, stats->marker_latency_max);
+    }
+    fflush(stdout);
+}
+
+
+int main(int argc, char* argv[])
+{
+    int                error          = 0;
+    int                from_file      = 0;
+    int                fail_on_gaps   = 0;
+    snd_pcm_format_t   format         = TARGET_FORMAT;
+    unsigned int       channels       = 2;
+    unsigned int       rate           = 44100;
+    snd_pcm_uframes_t  period_size    = 2048;
+    long               duration       = 0;
+    long               report_every   = 0;
+    snd_pcm_t*         pcm_handle     = NULL;
+    FILE*              file           = NULL;
+    unsigned char*     buffer         = NULL;
+    verify_stats_t     stats;
+    unsigned long long started_at;
+    unsigned long long reported_at;
+    unsigned long long reported_frames = 0;
+    int                option;
+
+    memset(&stats, 0, sizeof(stats));
+    log_file = stderr;
+
+    while ((option = getopt(argc, argv, "Ff:c:s:p:t:i:xv")) != -1)
+    {
+        switch (option)
+        {
+            case 'F':
+                from_file = 1;
+                break;
+            case 'f':
+                format = snd_pcm_format_value(optarg);
+                break;
+            case 'c':
+                channels = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                rate = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                period_size = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                duration = strtol(optarg, NULL, 10);
+                break;
+            case 'i':
+                report_every = strtol(optarg, NULL, 10);
+                break;
+            case 'x':
+                fail_on_gaps = 1;
+                break;
+            case 'v':
+                log_level = 3;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc || (format != TARGET_FORMAT && format != NATIVE_WIDTH_FORMAT) || !channels || !rate || !period_size || duration < 0 || report_every < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    size_t sample_size = snd_pcm_format_physical_width(format) >> 3;
+    size_t frame_size  = sample_size * (channels + 1);
+
+    /* SIGINT and SIGTERM finish verification with the final report */
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    if (from_file)
+    {
+        file = (strcmp(argv[optind], "-") == 0 ? stdin : fopen(argv[optind], "r"));
+        if (!file)
+        {
+            error = -errno;
+            LOG_ERROR("Could not open input file (error=%s, file name=%s)", strerror(errno), argv[optind]);
+        }
+    }
+    else
+    {
+        error = open_capture_device(argv[optind], format, channels, rate, period_size, &pcm_handle);
+    }
+    if (!error && !(buffer = malloc(period_size * frame_size)))
+    {
+        error = -ENOMEM;
+    }
+
+    started_at  = get_time_us();
+    reported_at = started_at;
+    while (!error && !stop_requested)
+    {
+        snd_pcm_sframes_t frames;
+        snd_pcm_sframes_t delay = 0;
+
+        if (file)
+        {
+            frames = fread(buffer, frame_size, period_size, file);
+            if (!frames)
+            {
+                break;
+            }
+        }
+        else if ((frames = snd_pcm_readi(pcm_handle, buffer, period_size)) < 0)
+        {
+            if (stop_requested)
+            {
+                break;
+            }
+
+            /* verifier was too slow; frames lost here are reported as a gap, so overruns are counted separately */
+            if (frames == -EPIPE)
+            {
+                stats.capture_overruns++;
+                LOG_WARNING("Capture overrun, verification results may contain false gaps");
+            }
+            if ((frames != -EPIPE && frames != -ESTRPIPE && frames != -EINTR) || (frames = snd_pcm_recover(pcm_handle, frames, 1)) < 0)
+            {
+                LOG_ERROR("Could not read from capture device: %s", snd_strerror(frames));
+                error = frames;
+                break;
+            }
+            continue;
+        }
+        else if (snd_pcm_delay(pcm_handle, &delay) < 0)
+        {
+            delay = 0;
+        }
+
+        for (snd_pcm_sframes_t f = 0; f < frames; f++)
+        {
+            unsigned char* frame  = buffer + f * frame_size;
+            unsigned int   marker = frame[frame_size - 1];
+
+            /* marker latency is the time since a marker was captured by loopback until it was read */
+            if (pcm_handle && marker != DATA_MARKER && marker != stats.last_marker)
+            {
+                unsigned long long latency = (unsigned long long)(frames - f - 1 + delay) * 1000000 / rate;
+
+                stats.marker_latency_sum += latency;
+                stats.marker_latency_max  = (latency > stats.marker_latency_max ? latency : stats.marker_latency_max);
+                stats.marker_latencies++;
+            }
+
+            check_frame(&stats, frame, sample_size, format, channels, rate);
+        }
+
+        unsigned long long now = get_time_us();
+        if (report_every && now - reported_at >= (unsigned long long)report_every * 1000000)
+        {
+            print_report(&stats, rate, now - started_at, stats.frames - reported_frames, now - reported_at);
+            fprintf(stdout, "\n");
+            reported_at     = now;
+            reported_frames = stats.frames;
+        }
+        if (duration && now - started_at >= (unsigned long long)duration * 1000000)
+        {
+            break;
+        }
+    }
+
+    /* results collected before a read error are still reported */
+    if (!error || stats.frames)
+    {
+        print_report(&stats, rate, get_time_us() - started_at, 0, 0);
+    }
+
+    if (pcm_handle)
+    {
+        snd_pcm_close(pcm_handle);
+    }
+    if (file && file != stdin)
+    {
+        fclose(file);
+    }
+    free(buffer);
+
+    if (error)
+    {
+        return 1;
+    }
+    if (stats.violations)
+    {
+        return 2;
+    }
+
+    return (fail_on_gaps && (stats.gaps || stats.xruns)) ? 3 : 0;
+}
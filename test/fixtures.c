@@ -0,0 +1,138 @@
+/*
+ * Copyright 2017, Andrej Kislovskij
+ *
+ * This is PUBLIC DOMAIN software so use at your own risk as it comes
+ * with no warranties. This code is yours to share, use and modify without
+ * any restrictions or obligations.
+ *
+ * For more information see conwrap/LICENSE or refer refer to http://unlicense.org
+ *
+ * Author: gimesketvirtadieni at gmail dot com (Andrej Kislovskij)
+ */
+
+/*
+ * slimplexor-fixtures writes PCM dumps used by 'make check' through the same code path as the plugin (ALSA 'null' device
+ * with PCM dump enabled), so the fixtures can be reviewed and rebuilt whenever the wire format changes:
+ *
+ *   - clean:  two 44100 Hz stereo S16 streams of 512 frames each (440 Hz sine), every one framed by beginning and
+ *             end of stream blocks
+ *   - faulty: the same streams, but the second one contains an xrun signature (xrun recovery after its 4th chunk)
+ *             and a 32 frame gap (unmarked silence after its 6th chunk)
+ */
+
+#include <math.h>
+#include <unistd.h>  /* unlink(...) */
+#include "slimplexor.h"
+
+
+#define FIXTURE_STREAMS     2
+#define FIXTURE_CHUNKS      8
+#define FIXTURE_CHUNK_SIZE  64
+#define FIXTURE_GAP_SIZE    32
+#define FIXTURE_XRUN_CHUNK  3
+#define FIXTURE_GAP_CHUNK   5
+
+
+__thread unsigned int log_level = 2;
+__thread FILE*        log_file  = NULL;
+
+
+static int write_fixture(const char* file_name, int faulty)
+{
+    int                    error = 0;
+    plugin_data_t          plugin_data;
+    int16_t                samples[2 * FIXTURE_CHUNK_SIZE];
+    unsigned char          gap[FIXTURE_GAP_SIZE * 3 * 4];  /* S32 frames of 2 channels and marker */
+    snd_pcm_channel_area_t areas[2];
+    char*                  info_file_name;
+
+    memset(&plugin_data, 0, sizeof(plugin_data));
+    memset(gap, 0, sizeof(gap));
+
+    plugin_data.alsa_data.channels = 2;
+    plugin_data.alsa_data.rate     = 44100;
+    plugin_data.src_format         = SND_PCM_FORMAT_S16_LE;
+    plugin_data.dst_format         = SND_PCM_FORMAT_S32_LE;
+    plugin_data.dst_channels       = 3;
+    plugin_data.dst_device         = "null";
+    plugin_data.dst_period_size    = FIXTURE_CHUNK_SIZE;
+    plugin_data.dst_periods        = 4;
+    plugin_data.xrun_prefill       = 1;
+    plugin_data.gain_current       = CONTROL_GAIN_UNITY;
+    plugin_data.gain_target        = CONTROL_GAIN_UNITY;
+    plugin_data.gain_step          = 1;
+    plugin_data.pcm_dump_file_name = file_name;
+    init_channel_matrices(&plugin_data);
+
+    for (unsigned int c = 0; c < 2; c++)
+    {
+        areas[c].addr  = samples;
+        areas[c].first = c * 16;
+        areas[c].step  = 32;
+    }
+
+    /* dump file is appended to by the plugin */
+    unlink(file_name);
+
+    if ((error = open_destination_device(&plugin_data)) < 0 || (error = set_dst_sw_params(&plugin_data, NULL)) < 0)
+    {
+        LOG_ERROR("Could not open destination device: %s", snd_strerror(error));
+        return error;
+    }
+
+    for (unsigned int s = 0; s < FIXTURE_STREAMS; s++)
+    {
+        write_stream_marker(&plugin_data, BEGINNING_OF_STREAM_MARKER);
+        plugin_data.transfer_started = 1;
+
+        for (unsigned int k = 0; k < FIXTURE_CHUNKS; k++)
+        {
+            for (unsigned int i = 0; i < FIXTURE_CHUNK_SIZE; i++)
+            {
+                samples[2 * i]     = (int16_t)(16000 * sin((k * FIXTURE_CHUNK_SIZE + i) * 2 * M_PI * 440 / 44100));
+                samples[2 * i + 1] = -samples[2 * i];
+            }
+            copy_frames(&plugin_data, areas, 0, FIXTURE_CHUNK_SIZE);
+            write_to_dst(&plugin_data);
+
+            if (faulty && s == 1 && k == FIXTURE_XRUN_CHUNK)
+            {
+                recover_destination_device(&plugin_data, -EPIPE);
+            }
+            if (faulty && s == 1 && k == FIXTURE_GAP_CHUNK)
+            {
+                write_to_pcm_dump_file(&plugin_data, gap, FIXTURE_GAP_SIZE);
+            }
+        }
+
+        write_stream_marker(&plugin_data, END_OF_STREAM_MARKER);
+        plugin_data.transfer_started = 0;
+    }
+
+    close_destination_device(&plugin_data);
+
+    /* verifier does not need stream parameters, so info file is not kept next to the fixture */
+    if ((info_file_name = malloc(strlen(file_name) + sizeof(PCM_DUMP_INFO_SUFFIX))))
+    {
+        strcpy(info_file_name, file_name);
+        strcat(info_file_name, PCM_DUMP_INFO_SUFFIX);
+        unlink(info_file_name);
+        free(info_file_name);
+    }
+
+    return error;
+}
+
+
+int main(int argc, char** argv)
+{
+    log_file = stderr;
+
+    if (argc != 3 || (strcmp(argv[1], "clean") && strcmp(argv[1], "faulty")))
+    {
+        fprintf(stderr, "Usage: %s clean|faulty <file>\n", argv[0]);
+        return 1;
+    }
+
+    return write_fixture(argv[2], strcmp(argv[1], "faulty") == 0) ? 1 : 0;
+}